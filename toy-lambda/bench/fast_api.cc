@@ -0,0 +1,83 @@
+// Compares host calls from optimized JS through V8 fast API bindings against
+// regular FunctionTemplate bindings.
+
+#include <chrono>
+#include <iostream>
+#include "include/libplatform/libplatform.h"
+#include "include/v8.h"
+#include "host_bindings.hh"
+
+// Host calls made by each timed run.
+const int iterations = 10000000;
+
+const char *bench_source =
+    "function run(n) {\n"
+    "    let sum = 0;\n"
+    "    for (let i = 0; i < n; i++) {\n"
+    "        host.kvSet('key', i);\n"
+    "        sum += host.kvGet('key');\n"
+    "    }\n"
+    "    return sum;\n"
+    "}\n";
+
+// Returns the average nanoseconds per host call.
+static double run_bench(v8::Isolate *isolate, bool fast_calls);
+
+int main(int argc, char* argv[]) {
+  v8::V8::InitializeICUDefaultLocation(argv[0]);
+  v8::V8::InitializeExternalStartupData(argv[0]);
+  std::unique_ptr<v8::Platform> platform = v8::platform::NewDefaultPlatform();
+  v8::V8::InitializePlatform(platform.get());
+  v8::V8::Initialize();
+
+  v8::Isolate::CreateParams create_params;
+  create_params.array_buffer_allocator =
+    v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+  v8::Isolate *isolate = v8::Isolate::New(create_params);
+
+  double regular_ns = run_bench(isolate, false);
+  double fast_ns = run_bench(isolate, true);
+  std::cout << "FunctionTemplate: " << regular_ns << " ns/call" << std::endl;
+  std::cout << "Fast API:         " << fast_ns << " ns/call" << std::endl;
+  std::cout << "Speedup:          " << regular_ns / fast_ns << "x" << std::endl;
+
+  isolate->Dispose();
+  delete create_params.array_buffer_allocator;
+  v8::V8::Dispose();
+  v8::V8::DisposePlatform();
+}
+
+static double run_bench(v8::Isolate *isolate, bool fast_calls) {
+  v8::Isolate::Scope isolate_scope(isolate);
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> context = v8::Context::New(isolate);
+  v8::Context::Scope context_scope(context);
+
+  HostInvocation invocation;
+  v8::Local<v8::Object> host =
+    new_host_object(context, create_host_template(isolate, fast_calls), &invocation)
+    .ToLocalChecked();
+  context->Global()->Set(context, v8::String::NewFromUtf8Literal(isolate, "host"), host)
+    .Check();
+
+  v8::Local<v8::String> source =
+    v8::String::NewFromUtf8(isolate, bench_source).ToLocalChecked();
+  v8::Script::Compile(context, source).ToLocalChecked()->Run(context).ToLocalChecked();
+  v8::Local<v8::Function> run = context->Global()
+    ->Get(context, v8::String::NewFromUtf8Literal(isolate, "run")).ToLocalChecked()
+    .As<v8::Function>();
+
+  // Warm up so TurboFan has optimized run() before it is timed.
+  v8::Local<v8::Value> warmup_args[] = {v8::Integer::New(isolate, iterations / 10)};
+  run->Call(context, run, 1, warmup_args).ToLocalChecked();
+
+  v8::Local<v8::Value> args[] = {v8::Integer::New(isolate, iterations)};
+  auto start = std::chrono::steady_clock::now();
+  run->Call(context, run, 1, args).ToLocalChecked();
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+  detach_host_object(host);
+
+  // Each iteration makes two host calls.
+  return elapsed.count() / (2.0 * iterations);
+}
@@ -0,0 +1,69 @@
+// Compares what preempting NaCl invocations costs on the fib function of
+// native_client_bin/a.out: no preemption, a deadline timer, and metering
+// with an instruction budget, which adds a performance counter started and
+// stopped around every call. Also reports the instructions each metered
+// call executes. Run from toy-lambda/.
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include "nacl_loader.hh"
+
+const char *const executable = "native_client_bin/a.out";
+const size_t memory_limit = 64UL << 20;
+
+// Calls timed for each mode.
+const int iterations = 20000;
+
+// Returns the average microseconds per call.
+static double run_bench(NaClContext &context);
+
+int main() {
+  struct Mode {
+    const char *name;
+    std::chrono::milliseconds deadline;
+    uint64_t instruction_budget;
+  };
+  const Mode modes[] = {
+    {"none", std::chrono::milliseconds(0), 0},
+    {"deadline", std::chrono::milliseconds(1000), 0},
+    {"instruction budget", std::chrono::milliseconds(0), 1UL << 40},
+  };
+
+  std::cout << "preemption          us per call   instructions per call" << std::endl;
+  for (const Mode &mode : modes) {
+    std::unique_ptr<NaClContext> context =
+      NaClContext::create_context(executable, memory_limit, mode.deadline, mode.instruction_budget);
+    if (context == nullptr) {
+      // Instruction budgets need counters many virtual machines lack.
+      std::cout << mode.name << "\t\tunavailable" << std::endl;
+      continue;
+    }
+    double us = run_bench(*context);
+    std::optional<uint64_t> instructions = NaClContext::last_call_instructions();
+    std::cout << mode.name << "\t\t" << us << "\t";
+    if (instructions.has_value()) {
+      std::cout << *instructions;
+    } else {
+      std::cout << "-";
+    }
+    std::cout << std::endl;
+  }
+}
+
+static double run_bench(NaClContext &context) {
+  // Warms up the stack and the pages f touches.
+  context.call<std::string_view()>();
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    if (!context.call<std::string_view()>().has_value()) {
+      std::cerr << "f() failed." << std::endl;
+    }
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / iterations;
+}
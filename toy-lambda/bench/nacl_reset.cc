@@ -0,0 +1,112 @@
+// Compares resetting a sandbox slot by dropping every page of it against
+// dropping only the pages written since the last reset, for a growing number
+// of written pages. Both leave the slot reading the snapshot again; the
+// incremental reset also keeps the pages that were only read mapped, so the
+// next call does not fault them back in.
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <utility>
+#include <vector>
+#include "dirty_pages.hh"
+#include "sandbox_slots.hh"
+
+extern "C" {
+#include <sys/mman.h>
+#include <unistd.h>
+}
+
+const unsigned long page_size = 4096;
+
+// Pages of the snapshot that each simulated call reads.
+const unsigned long image_pages = 256;
+
+// Resets timed for each number of written pages.
+const int iterations = 1000;
+
+struct Timing {
+  double reset_us;
+  double refault_us;
+};
+
+// Returns the average microseconds per reset, and per pass reading the image
+// back afterwards.
+static Timing run_bench(char *slot, unsigned long written_pages, bool incremental);
+
+int main() {
+  int fd = memfd_create("nacl-reset-bench", MFD_CLOEXEC);
+  if (fd == -1 || ftruncate(fd, sandbox_slot_size) != 0) {
+    perror("memfd_create()");
+    return 1;
+  }
+  std::vector<char> image(image_pages * page_size, 1);
+  if (pwrite(fd, image.data(), image.size(), 0) != (ssize_t) image.size()) {
+    perror("pwrite()");
+    return 1;
+  }
+
+  char *slot = (char*) mmap(nullptr, sandbox_slot_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+  if (slot == MAP_FAILED) {
+    perror("mmap()");
+    return 1;
+  }
+
+  if (!written_page_scan_supported()) {
+    std::cout << "PAGEMAP_SCAN is unsupported; only full resets are timed." << std::endl;
+  }
+
+  std::cout << "written pages   full reset   refault   incremental   refault" << std::endl;
+  for (unsigned long written_pages : {1, 4, 16, 64, 256, 1024}) {
+    Timing full = run_bench(slot, written_pages, false);
+    std::cout << written_pages << "\t\t" << full.reset_us << " us\t" << full.refault_us << " us";
+    if (written_page_scan_supported()) {
+      Timing incremental = run_bench(slot, written_pages, true);
+      std::cout << "\t" << incremental.reset_us << " us\t" << incremental.refault_us << " us";
+    }
+    std::cout << std::endl;
+  }
+
+  munmap(slot, sandbox_slot_size);
+  close(fd);
+}
+
+static Timing run_bench(char *slot, unsigned long written_pages, bool incremental) {
+  std::vector<std::pair<char*, size_t>> ranges;
+  std::chrono::duration<double, std::micro> reset_time(0);
+  std::chrono::duration<double, std::micro> refault_time(0);
+  volatile char sink = 0;
+
+  madvise(slot, sandbox_slot_size, MADV_DONTNEED);
+  for (int i = 0; i < iterations; i++) {
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long page = 0; page < image_pages; page++) {
+      sink = sink + slot[page * page_size];
+    }
+    refault_time += std::chrono::steady_clock::now() - start;
+
+    // Half the writes land in the image, half in memory past it, as the
+    // stack and heap would.
+    for (unsigned long page = 0; page < written_pages; page++) {
+      unsigned long offset = page % 2 == 0 ? page / 2 % image_pages : image_pages + page / 2;
+      slot[offset * page_size] = 2;
+    }
+
+    start = std::chrono::steady_clock::now();
+    if (incremental) {
+      find_written_pages(slot, sandbox_slot_size, ranges);
+      for (auto [page, length] : ranges) {
+        madvise(page, length, MADV_DONTNEED);
+      }
+    } else {
+      madvise(slot, sandbox_slot_size, MADV_DONTNEED);
+    }
+    reset_time += std::chrono::steady_clock::now() - start;
+  }
+
+  if (slot[0] != 1) {
+    std::cerr << "Reset did not restore the snapshot." << std::endl;
+  }
+  return Timing{reset_time.count() / iterations, refault_time.count() / iterations};
+}
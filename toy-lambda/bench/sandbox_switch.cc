@@ -0,0 +1,96 @@
+// Compares a round trip into a sandbox through sandbox_enter() against a
+// direct call through a pointer from dlsym(), in cycles per call, and times
+// a host call made from inside the sandbox through the host-call table.
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <x86intrin.h>
+#include "host_calls.hh"
+#include "sandbox_slots.hh"
+#include "sandbox_switch.hh"
+
+extern "C" {
+#include <dlfcn.h>
+}
+
+// Calls made by each timed run.
+const int iterations = 10000000;
+
+// Where the bench places things in its sandbox.
+const unsigned long trampoline_offset = 0x1000;
+const unsigned long target_offset = 0x2000;
+const unsigned long host_call_target_offset = 0x2040;
+const unsigned long host_call_table_offset = 0x3000;
+const unsigned long stack_top_offset = 0x100000;
+
+// Called in place of a host call's thunk: the bench runs no NaClContext for
+// a registered thunk to find.
+uint64_t identity(uint64_t value) {
+  return value;
+}
+
+// Returns cycles per sandbox_enter() of target, which gets i as its argument.
+double time_calls(char *slot, unsigned long target, uint64_t &sum) {
+  uint64_t args[6] = {};
+  unsigned long long start = __rdtsc();
+  for (int i = 0; i < iterations; i++) {
+    args[0] = i;
+    sum += sandbox_enter(slot, slot + trampoline_offset, slot + target,
+                         slot + stack_top_offset, args);
+  }
+  return (double) (__rdtsc() - start) / iterations;
+}
+
+int main() {
+  void *libc = dlopen("libc.so.6", RTLD_NOW);
+  long (*labs_function)(long) = libc == nullptr ? nullptr : (long (*)(long)) dlsym(libc, "labs");
+  if (labs_function == nullptr) {
+    std::cerr << "Unable to find labs(): " << dlerror() << std::endl;
+    return 1;
+  }
+
+  char *slot = SandboxSlotAllocator::instance().allocate();
+  if (slot == nullptr) {
+    std::cerr << "Unable to allocate a sandbox slot." << std::endl;
+    return 1;
+  }
+  std::string trampoline = sandbox_trampoline_code();
+  memcpy(slot + trampoline_offset, trampoline.data(), trampoline.size());
+  // movq %rdi, %rax; ret
+  memcpy(slot + target_offset, "\x48\x89\xf8\xc3", 4);
+
+  // A copy of the table's first entry, whose function the bench replaces
+  // with identity(): it makes no other host call.
+  std::string entry = HostCallTable::instance().code().substr(0, nacl_host_call_entry_size);
+  sandbox_host_thunks[0] = (uintptr_t) &identity;
+  memcpy(slot + host_call_table_offset, entry.data(), entry.size());
+  // Padding, then leaq entry(%r15), %r11; callq *%r11, ending on a bundle
+  // boundary so the masked return lands on the ret.
+  uint32_t entry_offset = host_call_table_offset;
+  memset(slot + host_call_target_offset, 0x90, 32);
+  memcpy(slot + host_call_target_offset + 22, "\x4d\x8d\x9f", 3);
+  memcpy(slot + host_call_target_offset + 25, &entry_offset, 4);
+  memcpy(slot + host_call_target_offset + 29, "\x41\xff\xd3\xc3", 4);
+
+  uint64_t sum = 0;
+  double sandbox_cycles = time_calls(slot, target_offset, sum);
+  double host_call_cycles = time_calls(slot, host_call_target_offset, sum);
+
+  // Called through a volatile pointer so the compiler cannot inline it.
+  long (*volatile direct)(long) = labs_function;
+  unsigned long long start = __rdtsc();
+  for (int i = 0; i < iterations; i++) {
+    sum += direct(i);
+  }
+  double direct_cycles = (double) (__rdtsc() - start) / iterations;
+
+  std::cout << "sandbox_enter(): " << sandbox_cycles << " cycles/call" << std::endl;
+  std::cout << "dlsym() pointer: " << direct_cycles << " cycles/call" << std::endl;
+  std::cout << "Overhead:        " << sandbox_cycles - direct_cycles << " cycles/call" << std::endl;
+  std::cout << "Host call:       " << host_call_cycles - sandbox_cycles << " cycles/call"
+            << std::endl;
+
+  SandboxSlotAllocator::instance().release(slot);
+  return sum == 3 * ((uint64_t) iterations * (iterations - 1) / 2) ? 0 : 1;
+}
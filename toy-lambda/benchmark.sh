@@ -34,8 +34,24 @@ echo "Shared library:"
 start_benchmark "fib.so"
 cleanup
 
+echo "Shared library (process tier):"
+start_benchmark "proc/fib.so"
+cleanup
+
 echo "NaCl:"
 start_benchmark "a.out"
 cleanup
 
+echo "NaCl (hello world):"
+start_benchmark "hello_world"
+cleanup
+
+echo "Wasm:"
+start_benchmark "fib.wasm"
+cleanup
+
+echo "Wasm (hello world):"
+start_benchmark "hello-world.wasm"
+cleanup
+
 echo "Finished"
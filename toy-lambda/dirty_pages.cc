@@ -0,0 +1,102 @@
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include "dirty_pages.hh"
+
+extern "C" {
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+}
+
+// Older kernel headers lack PAGEMAP_SCAN.
+#ifndef PAGEMAP_SCAN
+#define PAGE_IS_FILE (1 << 2)
+#define PAGE_IS_PRESENT (1 << 3)
+#define PAGE_IS_SWAPPED (1 << 4)
+#define PAGE_IS_PFNZERO (1 << 5)
+
+struct page_region {
+    __u64 start;
+    __u64 end;
+    __u64 categories;
+};
+
+struct pm_scan_arg {
+    __u64 size;
+    __u64 flags;
+    __u64 start;
+    __u64 end;
+    __u64 walk_end;
+    __u64 vec;
+    __u64 vec_len;
+    __u64 max_pages;
+    __u64 category_inverted;
+    __u64 category_mask;
+    __u64 category_anyof_mask;
+    __u64 return_mask;
+};
+
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+#endif
+
+using namespace std;
+
+namespace {
+
+// Regions returned by each PAGEMAP_SCAN call.
+const size_t scan_batch_size = 64;
+
+int pagemap_fd() {
+    static int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    return fd;
+}
+
+}
+
+bool written_page_scan_supported() {
+    static bool supported = [] {
+        vector<pair<char*, size_t>> ranges;
+        char page[1];
+        return find_written_pages(page, 0, ranges) || errno != ENOTTY;
+    }();
+    return supported;
+}
+
+bool find_written_pages(char *start, size_t length, vector<pair<char*, size_t>> &ranges) {
+    ranges.clear();
+    if (pagemap_fd() == -1) {
+        return false;
+    }
+
+    array<struct page_region, scan_batch_size> regions;
+    struct pm_scan_arg scan = {
+        .size = sizeof(scan),
+        .start = (uintptr_t) start,
+        .end = (uintptr_t) start + length,
+        .vec = (uintptr_t) regions.data(),
+        .vec_len = regions.size(),
+        // Present or swapped out, and neither a page of the file nor the
+        // shared zero page that reads of anonymous memory map.
+        .category_inverted = PAGE_IS_FILE | PAGE_IS_PFNZERO,
+        .category_mask = PAGE_IS_FILE | PAGE_IS_PFNZERO,
+        .category_anyof_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED,
+        .return_mask = PAGE_IS_FILE | PAGE_IS_PFNZERO,
+    };
+
+    // A full batch stops the walk early, at walk_end.
+    do {
+        int count = ioctl(pagemap_fd(), PAGEMAP_SCAN, &scan);
+        if (count < 0) {
+            return false;
+        }
+
+        for (int i = 0; i < count; i++) {
+            ranges.emplace_back((char*) regions[i].start, regions[i].end - regions[i].start);
+        }
+        scan.start = scan.walk_end;
+    } while (scan.start < scan.end);
+    return true;
+}
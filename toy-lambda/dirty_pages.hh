@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Finds the pages of private mappings that were written since they were
+// mapped. Writing a page of a private file mapping replaces it with an
+// anonymous copy, and reading anonymous memory maps the shared zero page, so
+// the written pages are exactly the present ones that are neither.
+// PAGEMAP_SCAN (Linux 6.7) finds those while walking only the page tables
+// that exist, which makes a scan of a sparse 4GB range cheap.
+
+// Returns whether find_written_pages() works on this kernel.
+bool written_page_scan_supported();
+
+// Replaces ranges with the runs of written pages in the length bytes at
+// start, as starts and lengths. Returns false on failure, in which case any
+// page in the range may have been written.
+bool find_written_pages(char *start, size_t length, std::vector<std::pair<char*, size_t>> &ranges);
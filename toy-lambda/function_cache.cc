@@ -0,0 +1,68 @@
+#include <thread>
+#include "function_cache.hh"
+#include "stats.hh"
+
+using namespace std;
+
+namespace {
+
+// Functions evicted to stay within the budget, and functions evicted
+// because their files changed.
+Counter &budget_evictions = stats_counter("function_cache_evictions{reason=\"budget\"}");
+Counter &stale_evictions = stats_counter("function_cache_evictions{reason=\"stale\"}");
+
+}
+
+FunctionCache::~FunctionCache() {
+    while (!entries.empty()) {
+        evict(entries.begin());
+    }
+}
+
+LoadedFunction* FunctionCache::find(const string &page, filesystem::file_time_type version) {
+    auto entry = entries.find(page);
+    if (entry == entries.end()) {
+        return nullptr;
+    }
+
+    if (entry->second.function.version != version) {
+        evict(entry);
+        stale_evictions.add();
+        return nullptr;
+    }
+
+    lru.splice(lru.begin(), lru, entry->second.use);
+    return &entry->second.function;
+}
+
+LoadedFunction& FunctionCache::insert(const string &page, LoadedFunction function) {
+    auto existing = entries.find(page);
+    if (existing != entries.end()) {
+        evict(existing);
+        stale_evictions.add();
+    }
+
+    used += function.bytes;
+    lru.push_front(page);
+    Entry &inserted = entries[page] = Entry{std::move(function), lru.begin()};
+
+    // The new entry stays even if it alone is over budget.
+    while (used > budget && lru.size() > 1) {
+        evict(entries.find(lru.back()));
+        budget_evictions.add();
+    }
+    return inserted.function;
+}
+
+void FunctionCache::evict(map<string, Entry>::iterator entry) {
+    on_evict(entry->first, entry->second.function);
+    used -= entry->second.function.bytes;
+    lru.erase(entry->second.use);
+
+    // Destroying a process pool waits for its outstanding requests, so do it
+    // off the caller's thread.
+    if (entry->second.function.process_pool != nullptr) {
+        thread([pool = std::move(entry->second.function.process_pool)] {}).detach();
+    }
+    entries.erase(entry);
+}
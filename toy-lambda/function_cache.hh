@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include "nacl_loader.hh"
+#include "native_worker_pool.hh"
+#include "process_pool.hh"
+#include "route_table.hh"
+
+// A function's runtime state, materialized on its first request. Which
+// fields are set depends on the function's runtime; JS isolates and Wasm
+// modules are owned by their runtimes and only named here.
+struct LoadedFunction {
+    FunctionRoute::Runtime runtime;
+    std::filesystem::file_time_type version;
+
+    // Estimated memory held for the function.
+    size_t bytes = 0;
+
+    std::string js_source;
+    std::shared_ptr<NativeLibrary> native_library;
+    std::shared_ptr<ProcessPool> process_pool;
+    // Shared with invocations parked on a fiber.
+    std::shared_ptr<NaClContext> nacl_context;
+};
+
+// Keeps loaded functions, by page, within a memory budget by evicting the
+// least recently used ones. Not thread-safe; used by the main thread only.
+class FunctionCache {
+public:
+    // on_evict is called for every entry removed from the cache, so runtimes
+    // can drop state the entry names.
+    FunctionCache(size_t budget,
+                  std::function<void(const std::string &page, LoadedFunction &function)> on_evict)
+        : budget(budget), on_evict(std::move(on_evict)) {}
+
+    ~FunctionCache();
+
+    FunctionCache(const FunctionCache &other) = delete;
+    FunctionCache& operator=(const FunctionCache &other) = delete;
+
+    // Returns page's entry and marks it used, or nullptr if it is not loaded.
+    // An entry loaded at a different version is evicted.
+    LoadedFunction* find(const std::string &page, std::filesystem::file_time_type version);
+
+    // Adds an entry, then evicts others until the cache fits its budget. The
+    // returned reference is valid until the next call to insert().
+    LoadedFunction& insert(const std::string &page, LoadedFunction function);
+
+private:
+    struct Entry {
+        LoadedFunction function;
+
+        // The entry's position in lru.
+        std::list<std::string>::iterator use;
+    };
+
+    void evict(std::map<std::string, Entry>::iterator entry);
+
+    const size_t budget;
+    size_t used = 0;
+    std::function<void(const std::string &page, LoadedFunction &function)> on_evict;
+
+    std::map<std::string, Entry> entries;
+
+    // Pages, most recently used first.
+    std::list<std::string> lru;
+};
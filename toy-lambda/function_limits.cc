@@ -0,0 +1,72 @@
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "function_limits.hh"
+
+using namespace std;
+
+namespace {
+
+bool set_limit(FunctionLimits &limits, const string &key, const string &value) {
+    char *end;
+    unsigned long number = strtoul(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0') {
+        return false;
+    }
+
+    if (key == "cpu_budget_ms") {
+        limits.cpu_budget = chrono::milliseconds(number);
+    } else if (key == "memory_limit_mb") {
+        limits.memory_limit = number * 1024UL * 1024UL;
+    } else if (key == "deadline_ms") {
+        limits.deadline = chrono::milliseconds(number);
+    } else if (key == "instructions") {
+        limits.instruction_budget = number;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+}
+
+optional<FunctionLimitsTable> FunctionLimitsTable::load(const string &path) {
+    FunctionLimitsTable table;
+    if (!filesystem::exists(path)) {
+        return table;
+    }
+
+    ifstream file(path);
+    string line;
+    for (int line_number = 1; getline(file, line); line_number++) {
+        istringstream fields(line);
+        string resource;
+        if (!(fields >> resource) || resource.starts_with("#")) {
+            continue;
+        }
+
+        FunctionLimits limits = table.defaults;
+        string setting;
+        while (fields >> setting) {
+            size_t equals = setting.find('=');
+            if (equals == string::npos ||
+                !set_limit(limits, setting.substr(0, equals), setting.substr(equals + 1))) {
+                cerr << path << ":" << line_number << ": bad setting " << setting << endl;
+                return {};
+            }
+        }
+
+        if (resource == "*") {
+            table.defaults = limits;
+        } else {
+            table.limits[resource] = limits;
+        }
+    }
+    return table;
+}
+
+const FunctionLimits& FunctionLimitsTable::get(const string &resource) const {
+    auto entry = limits.find(resource);
+    return entry == limits.end() ? defaults : entry->second;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+
+// Resource limits for one function.
+struct FunctionLimits {
+    // CPU time one invocation may use before it is terminated.
+    std::chrono::milliseconds cpu_budget{1000};
+
+    // Memory a NaCl sandbox may commit to its data, stack and heap.
+    size_t memory_limit = 64UL * 1024UL * 1024UL;
+
+    // Wall-clock time one NaCl invocation may take before it is aborted, and
+    // one async JS call may wait for its Promise before it is failed.
+    std::chrono::milliseconds deadline{1000};
+
+    // Instructions one NaCl invocation may execute before it is aborted, or
+    // 0 to run it unmetered.
+    uint64_t instruction_budget = 0;
+};
+
+// Per-resource limits read from a file of lines like
+//   <resource> <key>=<value> ...
+// where the resource "*" sets the defaults for lines that follow it. Blank
+// lines and lines starting with '#' are ignored. Known keys:
+//   cpu_budget_ms     FunctionLimits::cpu_budget
+//   memory_limit_mb   FunctionLimits::memory_limit
+//   deadline_ms       FunctionLimits::deadline
+//   instructions      FunctionLimits::instruction_budget
+class FunctionLimitsTable {
+public:
+    // Returns nothing if the file exists but cannot be parsed. A missing
+    // file gives every resource the default limits.
+    static std::optional<FunctionLimitsTable> load(const std::string &path);
+
+    const FunctionLimits& get(const std::string &resource) const;
+
+private:
+    FunctionLimits defaults;
+    std::map<std::string, FunctionLimits> limits;
+};
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <cctype>
+#include <optional>
+#include <string_view>
+#include "include/v8-fast-api-calls.h"
+#include "host_bindings.hh"
+#include "kv_store.hh"
+
+using namespace std;
+
+namespace {
+
+HostInvocation* unwrap(v8::Local<v8::Value> receiver) {
+    return static_cast<HostInvocation*>(
+        receiver.As<v8::Object>()->GetAlignedPointerFromInternalField(0));
+}
+
+// Fast calls receive strings as Latin-1, while the slow path sees UTF-8.
+// Converting here keeps the bytes identical whichever path V8 picks.
+string_view to_utf8(const v8::FastOneByteString &string, std::string &scratch) {
+    string_view latin1(string.data, string.length);
+    if (all_of(latin1.begin(), latin1.end(), [](char c) { return (c & 0x80) == 0; })) {
+        return latin1;
+    }
+
+    scratch.clear();
+    for (unsigned char c : latin1) {
+        if (c < 0x80) {
+            scratch += c;
+        } else {
+            scratch += static_cast<char>(0xc0 | (c >> 6));
+            scratch += static_cast<char>(0x80 | (c & 0x3f));
+        }
+    }
+    return scratch;
+}
+
+optional<string_view> find_header(string_view request, string_view name) {
+    size_t line_start = request.find("\r\n");
+    while (line_start != string_view::npos) {
+        line_start += 2;
+        size_t line_end = request.find("\r\n", line_start);
+        string_view line = request.substr(line_start, line_end - line_start);
+        if (line.empty()) {
+            break;
+        }
+
+        size_t colon = line.find(':');
+        if (colon == name.length() &&
+            equal(name.begin(), name.end(), line.begin(),
+                  [](char a, char b) { return tolower(a) == tolower(b); })) {
+            string_view value = line.substr(colon + 1);
+            while (!value.empty() && isspace(value.front())) {
+                value.remove_prefix(1);
+            }
+            return value;
+        }
+        line_start = line_end;
+    }
+    return {};
+}
+
+void fast_write(v8::Local<v8::Value> receiver, const v8::FastOneByteString &data) {
+    HostInvocation *invocation = unwrap(receiver);
+    if (invocation != nullptr) {
+        string scratch;
+        invocation->response += to_utf8(data, scratch);
+    }
+}
+
+void slow_write(const v8::FunctionCallbackInfo<v8::Value> &info) {
+    HostInvocation *invocation = unwrap(info.This());
+    if (invocation != nullptr && info.Length() > 0) {
+        invocation->response += *v8::String::Utf8Value(info.GetIsolate(), info[0]);
+    }
+}
+
+void slow_header(const v8::FunctionCallbackInfo<v8::Value> &info) {
+    HostInvocation *invocation = unwrap(info.This());
+    if (invocation == nullptr || info.Length() == 0) {
+        return;
+    }
+
+    v8::Isolate *isolate = info.GetIsolate();
+    optional<string_view> value =
+        find_header(invocation->request, *v8::String::Utf8Value(isolate, info[0]));
+    if (value.has_value()) {
+        v8::Local<v8::String> result;
+        if (v8::String::NewFromUtf8(isolate, value->data(), v8::NewStringType::kNormal,
+                                    value->length()).ToLocal(&result)) {
+            info.GetReturnValue().Set(result);
+        }
+    }
+}
+
+double fast_kv_get(v8::Local<v8::Value>, const v8::FastOneByteString &key) {
+    string scratch;
+    return KVStore::instance().get(to_utf8(key, scratch));
+}
+
+void slow_kv_get(const v8::FunctionCallbackInfo<v8::Value> &info) {
+    v8::String::Utf8Value key(info.GetIsolate(), info[0]);
+    info.GetReturnValue().Set(KVStore::instance().get(string_view(*key, key.length())));
+}
+
+void fast_kv_set(v8::Local<v8::Value>, const v8::FastOneByteString &key, double value) {
+    string scratch;
+    KVStore::instance().set(to_utf8(key, scratch), value);
+}
+
+void slow_kv_set(const v8::FunctionCallbackInfo<v8::Value> &info) {
+    v8::Isolate *isolate = info.GetIsolate();
+    v8::String::Utf8Value key(isolate, info[0]);
+    double value = info[1]->NumberValue(isolate->GetCurrentContext()).FromMaybe(0);
+    KVStore::instance().set(string_view(*key, key.length()), value);
+}
+
+// CFunction only keeps pointers to type information, so the descriptors must
+// outlive every template created from them.
+const v8::CFunction fast_write_function = v8::CFunction::Make(fast_write);
+const v8::CFunction fast_kv_get_function = v8::CFunction::Make(fast_kv_get);
+const v8::CFunction fast_kv_set_function = v8::CFunction::Make(fast_kv_set);
+
+void set_method(v8::Isolate *isolate, v8::Local<v8::FunctionTemplate> host_template,
+                const char *name, v8::FunctionCallback slow, int length,
+                const v8::CFunction *fast) {
+    v8::Local<v8::Signature> signature = v8::Signature::New(isolate, host_template);
+    host_template->PrototypeTemplate()->Set(
+        isolate, name,
+        v8::FunctionTemplate::New(isolate, slow, v8::Local<v8::Value>(), signature, length,
+                                  v8::ConstructorBehavior::kThrow,
+                                  v8::SideEffectType::kHasSideEffect, fast));
+}
+
+}
+
+v8::Local<v8::FunctionTemplate> create_host_template(v8::Isolate *isolate, bool fast_calls) {
+    v8::Local<v8::FunctionTemplate> host_template = v8::FunctionTemplate::New(isolate);
+    host_template->InstanceTemplate()->SetInternalFieldCount(1);
+
+    set_method(isolate, host_template, "write", slow_write, 1,
+               fast_calls ? &fast_write_function : nullptr);
+    set_method(isolate, host_template, "header", slow_header, 1, nullptr);
+    set_method(isolate, host_template, "kvGet", slow_kv_get, 1,
+               fast_calls ? &fast_kv_get_function : nullptr);
+    set_method(isolate, host_template, "kvSet", slow_kv_set, 2,
+               fast_calls ? &fast_kv_set_function : nullptr);
+    return host_template;
+}
+
+v8::MaybeLocal<v8::Object> new_host_object(v8::Local<v8::Context> context,
+                                           v8::Local<v8::FunctionTemplate> host_template,
+                                           HostInvocation *invocation) {
+    v8::Local<v8::Object> host;
+    if (!host_template->InstanceTemplate()->NewInstance(context).ToLocal(&host)) {
+        return {};
+    }
+    host->SetAlignedPointerInInternalField(0, invocation);
+    return host;
+}
+
+void detach_host_object(v8::Local<v8::Object> host) {
+    host->SetAlignedPointerInInternalField(0, nullptr);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include "include/v8.h"
+
+// The state of one call to a JS function's main(), reachable from JS through
+// the host object passed as main()'s argument.
+struct HostInvocation {
+    // The raw HTTP request.
+    std::string request;
+
+    // Bytes written by host.write(). Prepended to main()'s return value.
+    std::string response;
+};
+
+// Creates the template for host objects. Its methods are V8 fast API calls
+// with regular callbacks as the slow path:
+//   host.write(string)        appends to the response body.
+//   host.header(name)         returns a request header, or undefined.
+//   host.kvGet(key)           returns the number stored under key, or 0.
+//   host.kvSet(key, number)   stores a number under key.
+// host.header() returns a string, so it only has a regular callback.
+// Passing fast_calls = false creates regular bindings only, for comparison.
+v8::Local<v8::FunctionTemplate> create_host_template(v8::Isolate *isolate,
+                                                     bool fast_calls = true);
+
+// Creates a host object bound to invocation. The object must be detached
+// before invocation is destroyed.
+v8::MaybeLocal<v8::Object> new_host_object(v8::Local<v8::Context> context,
+                                           v8::Local<v8::FunctionTemplate> host_template,
+                                           HostInvocation *invocation);
+
+// Unbinds a host object, so a script that kept it around cannot reach a
+// finished invocation. Methods of a detached object do nothing.
+void detach_host_object(v8::Local<v8::Object> host);
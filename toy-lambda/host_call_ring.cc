@@ -0,0 +1,113 @@
+#include <algorithm>
+#include "host_call_ring.hh"
+#include "host_calls.hh"
+#include "stats.hh"
+
+using namespace std;
+
+namespace {
+
+// Idle polls that only yield before the poller starts sleeping between
+// polls, and how long it sleeps.
+const int spin_polls = 1000;
+const chrono::microseconds idle_sleep(50);
+
+Histogram &batch_sizes = stats_histogram("nacl_ring_batch");
+
+}
+
+static_assert(atomic<uint32_t>::is_always_lock_free && sizeof(atomic<uint32_t>) == sizeof(uint32_t),
+              "sandboxed code sees the indices as plain 32-bit words");
+
+HostCallPoller& HostCallPoller::instance() {
+    static HostCallPoller poller;
+    return poller;
+}
+
+void HostCallPoller::detach(NaClContext &context) {
+    lock_guard<mutex> guard(lock);
+    if (rings.erase(&context) > 0) {
+        context.pin_heap(false);
+    }
+}
+
+uint32_t HostCallPoller::attach_call(NaClContext &context, uint32_t ring) {
+    optional<span<HostCallRing>> memory = context.span_at<HostCallRing>(ring, 1);
+    if (ring % alignof(HostCallRing) != 0 || !memory.has_value()) {
+        return 1;
+    }
+
+    HostCallPoller &poller = instance();
+    lock_guard<mutex> guard(poller.lock);
+    if (poller.rings.contains(&context)) {
+        return 1;
+    }
+    context.pin_heap(true);
+    poller.rings[&context] = memory->data();
+    if (!poller.polling) {
+        // Runs for the life of the process.
+        thread(&HostCallPoller::poll, &poller).detach();
+        poller.polling = true;
+    }
+    poller.attached.notify_one();
+    return 0;
+}
+
+uint32_t HostCallPoller::enter_call(NaClContext &context) {
+    HostCallPoller &poller = instance();
+    lock_guard<mutex> guard(poller.lock);
+    auto ring = poller.rings.find(&context);
+    if (ring == poller.rings.end()) {
+        return 0;
+    }
+    return poller.serve(context, *ring->second);
+}
+
+void HostCallPoller::poll() {
+    int idle_polls = 0;
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        attached.wait(guard, [this] { return !rings.empty(); });
+
+        uint32_t served = 0;
+        for (auto [context, ring] : rings) {
+            served += serve(*context, *ring);
+        }
+        idle_polls = served > 0 ? 0 : idle_polls + 1;
+
+        // Let detach() and ring_enter in between polls.
+        guard.unlock();
+        if (idle_polls < spin_polls) {
+            this_thread::yield();
+        } else {
+            this_thread::sleep_for(idle_sleep);
+        }
+        guard.lock();
+    }
+}
+
+uint32_t HostCallPoller::serve(NaClContext &context, HostCallRing &ring) {
+    // The sandbox may write anything to the ring at any time, so every
+    // index is taken modulo the ring size and requests are copied out
+    // before they are looked at.
+    uint32_t tail = ring.submission_tail.load(memory_order_relaxed);
+    uint32_t completion = ring.completion_head.load(memory_order_relaxed);
+    uint32_t submitted = ring.submission_head.load(memory_order_acquire) - tail;
+    uint32_t pending = completion - ring.completion_tail.load(memory_order_acquire);
+    uint32_t count = min({submitted, HostCallRing::slot_count - min(pending, HostCallRing::slot_count),
+                          HostCallRing::slot_count});
+    for (uint32_t i = 0; i < count; i++) {
+        HostCallRequest request = ring.submissions[(tail + i) % HostCallRing::slot_count];
+        optional<uint64_t> result =
+            HostCallTable::instance().apply(context, request.entry, request.registers);
+        ring.completions[(completion + i) % HostCallRing::slot_count] = HostCallCompletion{
+            request.tag, result.has_value() ? host_call_done : host_call_unavailable,
+            result.value_or(0)};
+    }
+    if (count > 0) {
+        ring.completion_head.store(completion + count, memory_order_release);
+        ring.submission_tail.store(tail + count, memory_order_release);
+        batch_sizes.record(count);
+    }
+    return count;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "nacl_loader.hh"
+
+// Host calls that sandboxed code queues in its own memory instead of making
+// through the host-call table, so making one costs a few stores rather than
+// a transition. A poller thread serves queued calls in batches and posts
+// their results to a completion queue the sandbox polls.
+//
+// The ring is a plain C struct in sandbox memory, 64-byte aligned. The
+// sandbox attaches it with the ring_attach host call, then pushes requests
+// at submission_head and pops completions at completion_tail, with release
+// stores and acquire loads of the indices. Requests name a host-call table
+// entry by its address and carry the entry's argument registers. Calls
+// that are not ring-safe complete with host_call_unavailable. The ring_enter
+// host call serves the ring on the sandbox's thread, for when it would
+// rather not wait for the poller. The ring and any memory its requests
+// point to must stay in the sandbox's data, bss or heap; the heap does not
+// shrink while a ring is attached. reset() detaches the ring.
+struct HostCallRequest {
+    uint32_t entry;
+    // Copied to the completion, to match the two up.
+    uint32_t tag;
+    uint64_t registers[6];
+};
+
+enum HostCallStatus : uint32_t {
+    host_call_done = 0,
+    host_call_unavailable = 1,
+};
+
+struct HostCallCompletion {
+    uint32_t tag;
+    HostCallStatus status;
+    uint64_t result;
+};
+
+struct HostCallRing {
+    static const uint32_t slot_count = 64;
+
+    // Written by the sandbox only.
+    alignas(64) std::atomic<uint32_t> submission_head;
+    alignas(64) std::atomic<uint32_t> completion_tail;
+
+    // Written by the host only.
+    alignas(64) std::atomic<uint32_t> submission_tail;
+    alignas(64) std::atomic<uint32_t> completion_head;
+
+    HostCallRequest submissions[slot_count];
+    HostCallCompletion completions[slot_count];
+};
+
+// Serves the rings of every sandbox that has one attached.
+class HostCallPoller {
+public:
+    static HostCallPoller& instance();
+
+    HostCallPoller(const HostCallPoller &other) = delete;
+    HostCallPoller& operator=(const HostCallPoller &other) = delete;
+
+    // Detaches context's ring, if it has one, waiting for the poller to
+    // finish with it.
+    void detach(NaClContext &context);
+
+    // The ring_attach and ring_enter host calls. ring_attach returns 0 on
+    // success. ring_enter returns the number of requests it served.
+    static uint32_t attach_call(NaClContext &context, uint32_t ring);
+    static uint32_t enter_call(NaClContext &context);
+
+private:
+    HostCallPoller() = default;
+
+    // Polls the attached rings until the process exits, backing off when
+    // they are idle.
+    void poll();
+
+    // Serves one batch of ring's requests for context. Returns the number
+    // served. Must hold lock.
+    uint32_t serve(NaClContext &context, HostCallRing &ring);
+
+    std::mutex lock;
+    std::condition_variable attached;
+    std::map<NaClContext*, HostCallRing*> rings;
+    bool polling = false;
+};
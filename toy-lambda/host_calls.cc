@@ -0,0 +1,104 @@
+#include <cstring>
+#include <iostream>
+#include "host_call_ring.hh"
+#include "host_calls.hh"
+#include "sandbox_switch.hh"
+
+using namespace std;
+
+namespace {
+
+uint32_t host_lookup(NaClContext &context, uint32_t name) {
+    optional<string_view> entry_name = context.string_at(name);
+    if (!entry_name.has_value()) {
+        return 0;
+    }
+    return HostCallTable::instance().find(string(*entry_name)).value_or(0);
+}
+
+uint32_t host_sbrk(NaClContext &context, int32_t increment) {
+    return context.sbrk(increment).value_or(nacl_sbrk_failed);
+}
+
+// One entry, with its index at offset 1 and sandbox_host_rsp_offset() at
+// offset 10. Like the trampoline, it finds sandbox_host_call through the
+// host stack pointer:
+//   movl $index, %eax
+//   movq %fs:offset, %r11
+//   jmpq *24(%r11)
+//   int3 padding
+const char entry_code[] =
+    "\xb8\x00\x00\x00\x00"
+    "\x64\x4c\x8b\x1c\x25\x00\x00\x00\x00"
+    "\x41\xff\x63\x18"
+    "\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xcc";
+
+static_assert(sizeof(entry_code) - 1 == nacl_host_call_entry_size);
+
+}
+
+uintptr_t sandbox_host_thunks[nacl_host_call_capacity];
+
+HostCallTable& HostCallTable::instance() {
+    static HostCallTable table;
+    return table;
+}
+
+HostCallTable::HostCallTable() {
+    // The heap and the ring belong to the sandbox's own thread.
+    add<host_lookup>("lookup");
+    add<host_sbrk>("sbrk", false);
+    add<HostCallPoller::attach_call>("ring_attach", false);
+    add<HostCallPoller::enter_call>("ring_enter", false);
+}
+
+optional<uint32_t> HostCallTable::add(const string &name, Entry entry) {
+    lock_guard<mutex> guard(lock);
+    if (entries.contains(name) || table.size() == nacl_host_call_capacity) {
+        cerr << "Unable to register host call " << name << "." << endl;
+        return {};
+    }
+
+    uint32_t address = nacl_host_call_table + table.size() * nacl_host_call_entry_size;
+    sandbox_host_thunks[table.size()] = entry.thunk;
+    table.push_back(entry);
+    entries[name] = address;
+    return address;
+}
+
+optional<uint32_t> HostCallTable::find(const string &name) {
+    lock_guard<mutex> guard(lock);
+    auto entry = entries.find(name);
+    if (entry == entries.end()) {
+        return {};
+    }
+    return entry->second;
+}
+
+optional<uint64_t> HostCallTable::apply(NaClContext &context, uint32_t address,
+                                        const uint64_t *registers) {
+    uint32_t index = (address - nacl_host_call_table) / nacl_host_call_entry_size;
+    Entry entry;
+    {
+        lock_guard<mutex> guard(lock);
+        if (address < nacl_host_call_table || address % nacl_host_call_entry_size != 0 ||
+            index >= table.size() || !table[index].ring_safe) {
+            return {};
+        }
+        entry = table[index];
+    }
+    return entry.apply(context, registers);
+}
+
+string HostCallTable::code() {
+    lock_guard<mutex> guard(lock);
+    string code;
+    int32_t offset = (int32_t) sandbox_host_rsp_offset();
+    for (uint32_t index = 0; index < table.size(); index++) {
+        size_t start = code.size();
+        code.append(entry_code, nacl_host_call_entry_size);
+        memcpy(&code[start + 1], &index, sizeof(index));
+        memcpy(&code[start + 10], &offset, sizeof(offset));
+    }
+    return code;
+}
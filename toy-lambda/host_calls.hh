@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "nacl_loader.hh"
+
+// Sandboxed code calls host functions through a table of 32-byte entries at
+// nacl_host_call_table, in the sandbox's read-only trampoline page. Each
+// entry holds only its own index, and calls its host function through
+// sandbox_host_call(), which looks the function up in host memory, so the
+// page gives away no host address. The function runs on the host's stack
+// rather than the sandbox's, and returns to the caller through a
+// return address masked into the sandbox, as sandboxed code's own returns
+// are, so a forged return address cannot leave the sandbox. Arguments and
+// results travel in the SysV registers.
+const uint32_t nacl_host_call_table = 0xfffff000;
+const uint32_t nacl_host_call_entry_size = 32;
+
+// Entries that fit before the trampoline.
+const size_t nacl_host_call_capacity = 125;
+
+// The first entries are always there:
+//   uint32_t lookup(const char *name) returns the address of the entry
+//     registered as name, or 0.
+//   uint32_t sbrk(int32_t increment) calls NaClContext::sbrk(), returning
+//     nacl_sbrk_failed on failure.
+//   uint32_t ring_attach(HostCallRing *ring) and uint32_t ring_enter(void),
+//     see host_call_ring.hh.
+const uint32_t nacl_host_lookup_address = nacl_host_call_table;
+const uint32_t nacl_sbrk_address = nacl_host_call_table + nacl_host_call_entry_size;
+const uint32_t nacl_ring_attach_address = nacl_host_call_table + 2 * nacl_host_call_entry_size;
+const uint32_t nacl_ring_enter_address = nacl_host_call_table + 3 * nacl_host_call_entry_size;
+const uint32_t nacl_sbrk_failed = 0xffffffff;
+
+// The host functions that sandboxed code can call. Register functions
+// before creating the contexts that should see them: each context's table
+// is fixed when it is created. Safe to use from any thread.
+class HostCallTable {
+public:
+    static HostCallTable& instance();
+
+    HostCallTable(const HostCallTable &other) = delete;
+    HostCallTable& operator=(const HostCallTable &other) = delete;
+
+    // Registers function, of type R(NaClContext&, Args...), under name.
+    // Args and R must be integers or enums; R may be void. The context is
+    // the one whose code made the call, and pointers arrive as 32-bit
+    // sandbox offsets for NaClContext::span_at() and string_at(). Unless
+    // ring_safe is false, the function may also be called through a
+    // HostCallRing, on another thread while the sandbox runs. Returns the
+    // entry's sandbox address, or nothing if the name is taken or the
+    // table is full.
+    template <auto function>
+    std::optional<uint32_t> add(const std::string &name, bool ring_safe = true) {
+        using Thunk = HostThunk<decltype(function), function>;
+        return add(name, Entry{(uintptr_t) &Thunk::call, &Thunk::apply, ring_safe});
+    }
+
+    // Returns the address of the entry registered as name.
+    std::optional<uint32_t> find(const std::string &name);
+
+    // Calls the function at the entry address for context with the given
+    // argument registers, as a HostCallRing does. Returns nothing if there
+    // is no such entry or it is not ring-safe.
+    std::optional<uint64_t> apply(NaClContext &context, uint32_t address,
+                                  const uint64_t *registers);
+
+    // Returns the machine code of the table as it stands.
+    std::string code();
+
+private:
+    template <typename Signature, auto function>
+    struct HostThunk;
+
+    // Unpacks the argument registers for function and packs its result.
+    template <auto function, typename R, typename... Args>
+    struct HostThunk<R (*)(NaClContext&, Args...), function> {
+        static_assert(sizeof...(Args) <= 6, "host calls take at most six arguments");
+        static_assert(((std::is_integral_v<Args> || std::is_enum_v<Args>) && ...),
+                      "host call arguments are integers or enums");
+
+        static uint64_t apply(NaClContext &context, const uint64_t *registers) {
+            return [&]<size_t... I>(std::index_sequence<I...>) -> uint64_t {
+                if constexpr (std::is_void_v<R>) {
+                    function(context, sandbox_register_value<Args>(registers[I])...);
+                    return 0;
+                } else {
+                    return (uint64_t) function(context, sandbox_register_value<Args>(registers[I])...);
+                }
+            }(std::index_sequence_for<Args...>{});
+        }
+
+        // Called by the entry's code.
+        static uint64_t call(uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
+                             uint64_t a5) {
+            const uint64_t registers[] = {a0, a1, a2, a3, a4, a5};
+            return apply(NaClContext::current(), registers);
+        }
+    };
+
+    struct Entry {
+        uintptr_t thunk;
+        uint64_t (*apply)(NaClContext &context, const uint64_t *registers);
+        bool ring_safe;
+    };
+
+    HostCallTable();
+
+    std::optional<uint32_t> add(const std::string &name, Entry entry);
+
+    std::mutex lock;
+
+    // The entries in table order, and their addresses by name.
+    std::vector<Entry> table;
+    std::map<std::string, uint32_t> entries;
+};
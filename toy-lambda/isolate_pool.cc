@@ -0,0 +1,414 @@
+#include <iostream>
+#include "include/libplatform/libplatform.h"
+#include "isolate_pool.hh"
+#include "stats.hh"
+
+using namespace std;
+
+namespace {
+
+// True while the pool runs idle tasks, so GC pauses can be attributed to
+// either the request path or the idle path.
+bool collecting_idle_garbage = false;
+
+chrono::steady_clock::time_point gc_start;
+
+Histogram &gc_request_path_us = stats_histogram("js_gc_request_path_us");
+Histogram &gc_idle_us = stats_histogram("js_gc_idle_us");
+Histogram &idle_window_us = stats_histogram("js_isolate_idle_window_us");
+Counter &isolate_rotations = stats_counter("js_isolate_rotations");
+
+void on_gc_prologue(v8::Isolate*, v8::GCType, v8::GCCallbackFlags, void*) {
+    gc_start = chrono::steady_clock::now();
+}
+
+void on_gc_epilogue(v8::Isolate*, v8::GCType, v8::GCCallbackFlags, void*) {
+    auto elapsed = chrono::steady_clock::now() - gc_start;
+    uint64_t us = chrono::duration_cast<chrono::microseconds>(elapsed).count();
+    if (collecting_idle_garbage) {
+        gc_idle_us.record(us);
+    } else {
+        gc_request_path_us.record(us);
+    }
+}
+
+}
+
+unique_ptr<PooledIsolate> PooledIsolate::create(const string &resource, const string &source,
+                                                const FunctionLimits &limits,
+                                                ExecutionWatchdog *watchdog) {
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator =
+        v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+
+    v8::Isolate *isolate = v8::Isolate::New(create_params);
+    unique_ptr<PooledIsolate> pooled(
+        new PooledIsolate(isolate, create_params.array_buffer_allocator, resource, source,
+                          limits, watchdog));
+    isolate->AddGCPrologueCallback(on_gc_prologue);
+    isolate->AddGCEpilogueCallback(on_gc_epilogue);
+
+    isolate->SetMicrotasksPolicy(v8::MicrotasksPolicy::kExplicit);
+
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::FunctionTemplate> host_template = create_host_template(isolate);
+    v8::Local<v8::ObjectTemplate> global = v8::ObjectTemplate::New(isolate);
+    global->Set(isolate, "sleep",
+                v8::FunctionTemplate::New(isolate, sleep, v8::External::New(isolate, pooled.get())));
+    v8::Local<v8::Context> context = v8::Context::New(isolate, nullptr, global);
+    v8::Context::Scope context_scope(context);
+
+    v8::Local<v8::String> source_string =
+        v8::String::NewFromUtf8(isolate, source.c_str(),
+                                v8::NewStringType::kNormal).ToLocalChecked();
+
+    v8::Local<v8::Script> script;
+    if (!v8::Script::Compile(context, source_string).ToLocal(&script) ||
+        script->Run(context).IsEmpty()) {
+        cerr << "Unable to compile JS resource." << endl;
+        return nullptr;
+    }
+
+    v8::Local<v8::Value> main_func;
+    if (!context->Global()->Get(context, v8::String::NewFromUtf8Literal(isolate, "main"))
+        .ToLocal(&main_func) || !main_func->IsFunction()) {
+        cerr << "Error: function main() is missing." << endl;
+        return nullptr;
+    }
+
+    pooled->context.Reset(isolate, context);
+    pooled->main_func.Reset(isolate, main_func.As<v8::Function>());
+    pooled->host_template.Reset(isolate, host_template);
+    return pooled;
+}
+
+PooledIsolate::~PooledIsolate() {
+    for (PendingCall &pending : pending_calls) {
+        pending.done({JSResult::failed});
+    }
+    pending_calls.clear();
+    timers.clear();
+    host_template.Reset();
+    main_func.Reset();
+    context.Reset();
+    isolate->Dispose();
+    delete allocator;
+}
+
+void PooledIsolate::call(const string &request, JSCallback done) {
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = this->context.Get(isolate);
+    v8::Context::Scope context_scope(context);
+
+    auto invocation = make_unique<HostInvocation>();
+    invocation->request = request;
+    v8::Local<v8::Object> host;
+    if (!new_host_object(context, host_template.Get(isolate), invocation.get()).ToLocal(&host)) {
+        done({JSResult::failed});
+        return;
+    }
+
+    v8::Local<v8::Function> main_func = this->main_func.Get(isolate);
+    v8::Local<v8::Value> argv[] = {host};
+    v8::Local<v8::Value> rvalue;
+    watchdog->arm(isolate, limits.cpu_budget);
+    bool returned = main_func->Call(context, main_func, 1, argv).ToLocal(&rvalue);
+
+    // Run an async function up to its first real suspension point; most
+    // Promises returned without awaiting host work settle right here.
+    if (returned && rvalue->IsPromise()) {
+        isolate->PerformMicrotaskCheckpoint();
+    }
+
+    if (disarm_watchdog()) {
+        detach_host_object(host);
+        done({JSResult::over_budget});
+        return;
+    }
+
+    if (!returned) {
+        detach_host_object(host);
+        done({JSResult::failed});
+        return;
+    }
+
+    if (!rvalue->IsPromise()) {
+        done(settle(rvalue, host, *invocation));
+        return;
+    }
+
+    v8::Local<v8::Promise> promise = rvalue.As<v8::Promise>();
+    if (promise->State() != v8::Promise::kPending) {
+        done(settle(promise, host, *invocation));
+        return;
+    }
+
+    pending_calls.push_back({
+        chrono::steady_clock::now() + limits.deadline,
+        v8::Global<v8::Promise>(isolate, promise),
+        v8::Global<v8::Object>(isolate, host),
+        std::move(invocation),
+        std::move(done),
+    });
+}
+
+void PooledIsolate::pump() {
+    if (!has_pending_work()) {
+        return;
+    }
+
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = this->context.Get(isolate);
+    v8::Context::Scope context_scope(context);
+
+    auto now = chrono::steady_clock::now();
+    for (auto timer = timers.begin(); timer != timers.end();) {
+        if (timer->deadline <= now) {
+            timer->resolver.Get(isolate)->Resolve(context, v8::Undefined(isolate)).FromMaybe(false);
+            timer = timers.erase(timer);
+        } else {
+            timer++;
+        }
+    }
+
+    watchdog->arm(isolate, limits.cpu_budget);
+    isolate->PerformMicrotaskCheckpoint();
+    if (disarm_watchdog()) {
+        // Any of the pending calls may have been running, and the others may
+        // be waiting on it, so none of them can finish.
+        vector<PendingCall> failed = std::move(pending_calls);
+        pending_calls.clear();
+        timers.clear();
+        poisoned = true;
+        for (PendingCall &pending : failed) {
+            detach_host_object(pending.host.Get(isolate));
+            pending.done({JSResult::over_budget});
+        }
+        return;
+    }
+
+    // Callbacks may write to clients, so collect them before running any.
+    vector<pair<JSCallback, JSResult>> finished;
+    for (auto pending = pending_calls.begin(); pending != pending_calls.end();) {
+        v8::Local<v8::Promise> promise = pending->promise.Get(isolate);
+        if (promise->State() == v8::Promise::kPending) {
+            pending++;
+            continue;
+        }
+
+        finished.emplace_back(std::move(pending->done),
+                              settle(promise, pending->host.Get(isolate), *pending->invocation));
+        pending = pending_calls.erase(pending);
+    }
+
+    // A Promise that never settles would keep its client waiting forever.
+    // The script may still settle it later, with nobody left to answer.
+    for (auto pending = pending_calls.begin(); pending != pending_calls.end();) {
+        if (pending->deadline > now) {
+            pending++;
+            continue;
+        }
+
+        detach_host_object(pending->host.Get(isolate));
+        finished.emplace_back(std::move(pending->done), JSResult{JSResult::timed_out});
+        pending = pending_calls.erase(pending);
+    }
+
+    for (auto &[done, result] : finished) {
+        done(std::move(result));
+    }
+}
+
+void PooledIsolate::sleep(const v8::FunctionCallbackInfo<v8::Value> &info) {
+    v8::Isolate *isolate = info.GetIsolate();
+    PooledIsolate *pooled = static_cast<PooledIsolate*>(info.Data().As<v8::External>()->Value());
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
+
+    v8::Local<v8::Promise::Resolver> resolver;
+    if (!v8::Promise::Resolver::New(context).ToLocal(&resolver)) {
+        return;
+    }
+
+    int64_t ms = info.Length() > 0 ? info[0]->IntegerValue(context).FromMaybe(0) : 0;
+    pooled->timers.push_back({
+        chrono::steady_clock::now() + chrono::milliseconds(max<int64_t>(ms, 0)),
+        v8::Global<v8::Promise::Resolver>(isolate, resolver),
+    });
+    info.GetReturnValue().Set(resolver->GetPromise());
+}
+
+JSResult PooledIsolate::settle(v8::Local<v8::Value> value, v8::Local<v8::Object> host,
+                               const HostInvocation &invocation) {
+    detach_host_object(host);
+
+    if (value->IsPromise()) {
+        v8::Local<v8::Promise> promise = value.As<v8::Promise>();
+        if (promise->State() != v8::Promise::kFulfilled) {
+            return {JSResult::failed};
+        }
+        value = promise->Result();
+    }
+
+    if (value->IsUndefined()) {
+        return {JSResult::ok, invocation.response};
+    }
+
+    if (!value->IsString()) {
+        return {JSResult::failed};
+    }
+
+    return {JSResult::ok, invocation.response + *v8::String::Utf8Value(isolate, value)};
+}
+
+bool PooledIsolate::disarm_watchdog() {
+    if (!watchdog->disarm()) {
+        return false;
+    }
+
+    // The termination may have been requested after JS already returned, so
+    // it has to be cancelled even if nothing observed it.
+    isolate->CancelTerminateExecution();
+    return true;
+}
+
+bool PooledIsolate::idle_notification(double deadline) {
+    v8::Isolate::Scope isolate_scope(isolate);
+    return isolate->IdleNotificationDeadline(deadline);
+}
+
+void PooledIsolate::low_memory_notification() {
+    v8::Isolate::Scope isolate_scope(isolate);
+    isolate->LowMemoryNotification();
+}
+
+size_t PooledIsolate::used_heap_size() {
+    v8::HeapStatistics heap_statistics;
+    isolate->GetHeapStatistics(&heap_statistics);
+    return heap_statistics.used_heap_size();
+}
+
+void IsolatePool::call(const string &resource, const string &source,
+                       const FunctionLimits &limits, const string &request, JSCallback done) {
+    PooledIsolate *isolate = get_or_create(resource, source, limits);
+    if (isolate == nullptr) {
+        done({JSResult::failed});
+        return;
+    }
+    isolate->limits = limits;
+
+    done = [done = std::move(done), &overruns = isolate->budget_overruns,
+            &timeouts = isolate->timeouts](JSResult result) {
+        if (result.status == JSResult::over_budget) {
+            overruns.add();
+        } else if (result.status == JSResult::timed_out) {
+            timeouts.add();
+        }
+        done(std::move(result));
+    };
+
+    if (isolate->last_used != chrono::steady_clock::time_point()) {
+        auto idle_window = chrono::steady_clock::now() - isolate->last_used;
+        idle_window_us.record(chrono::duration_cast<chrono::microseconds>(idle_window).count());
+    }
+
+    isolate->call(request, std::move(done));
+
+    isolate->last_used = chrono::steady_clock::now();
+    isolate->idle_work_done = false;
+    isolate->low_memory_done = false;
+}
+
+void IsolatePool::evict(const string &resource) {
+    auto entry = isolates.find(resource);
+    if (entry == isolates.end()) {
+        return;
+    }
+
+    if (entry->second->has_pending_work()) {
+        draining.push_back(std::move(entry->second));
+    }
+    isolates.erase(entry);
+}
+
+void IsolatePool::pump() {
+    for (auto entry = isolates.begin(); entry != isolates.end();) {
+        entry->second->pump();
+        if (entry->second->poisoned) {
+            entry = isolates.erase(entry);
+        } else {
+            entry++;
+        }
+    }
+
+    for (auto isolate = draining.begin(); isolate != draining.end();) {
+        (*isolate)->pump();
+        if ((*isolate)->poisoned || !(*isolate)->has_pending_work()) {
+            isolate = draining.erase(isolate);
+        } else {
+            isolate++;
+        }
+    }
+}
+
+void IsolatePool::run_idle_tasks(chrono::milliseconds budget) {
+    double deadline = platform->MonotonicallyIncreasingTime() +
+        chrono::duration<double>(budget).count();
+    auto now = chrono::steady_clock::now();
+
+    collecting_idle_garbage = true;
+    for (auto &[resource, isolate] : isolates) {
+        if (platform->MonotonicallyIncreasingTime() >= deadline) {
+            break;
+        }
+
+        if (isolate->idle_work_done && isolate->low_memory_done) {
+            continue;
+        }
+
+        v8::platform::PumpMessageLoop(platform, isolate->get_isolate());
+
+        if (!isolate->has_pending_work() &&
+            isolate->used_heap_size() > isolate_heap_rotation_threshold) {
+            unique_ptr<PooledIsolate> replacement =
+                PooledIsolate::create(resource, isolate->get_source(), isolate->limits, &watchdog);
+            if (replacement != nullptr) {
+                isolate = std::move(replacement);
+                isolate_rotations.add();
+                continue;
+            }
+        }
+
+        if (!isolate->idle_work_done) {
+            isolate->idle_work_done = isolate->idle_notification(deadline);
+        } else if (now - isolate->last_used > isolate_low_memory_idle_time) {
+            isolate->low_memory_notification();
+            isolate->low_memory_done = true;
+        }
+    }
+    collecting_idle_garbage = false;
+}
+
+PooledIsolate* IsolatePool::get_or_create(const string &resource, const string &source,
+                                          const FunctionLimits &limits) {
+    unique_ptr<PooledIsolate> &isolate = isolates[resource];
+    if (isolate != nullptr && isolate->get_source() != source) {
+        // The resource was reloaded. Calls already made finish on the old
+        // version.
+        if (isolate->has_pending_work()) {
+            draining.push_back(std::move(isolate));
+        }
+        isolate = nullptr;
+    }
+
+    if (isolate == nullptr) {
+        isolate = PooledIsolate::create(resource, source, limits, &watchdog);
+        if (isolate == nullptr) {
+            isolates.erase(resource);
+            return nullptr;
+        }
+    }
+    return isolate.get();
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "include/v8.h"
+#include "function_limits.hh"
+#include "host_bindings.hh"
+#include "stats.hh"
+#include "watchdog.hh"
+
+// Heaps larger than this are rotated out the next time the server is idle.
+const size_t isolate_heap_rotation_threshold = 64UL * 1024UL * 1024UL;
+
+// Isolates idle for longer than this get a full, memory-reducing GC.
+const std::chrono::milliseconds isolate_low_memory_idle_time(1000);
+
+// The outcome of a call to main().
+struct JSResult {
+    enum Status {
+        // main() produced a string or undefined.
+        ok,
+        // main() threw, was rejected or produced any other value.
+        failed,
+        // main() ran out of CPU budget and was terminated.
+        over_budget,
+        // main()'s Promise did not settle before the call's deadline.
+        timed_out,
+    };
+
+    Status status;
+
+    // Whatever main() wrote through host.write(), followed by the string it
+    // returned. Empty unless status is ok.
+    std::string body;
+};
+
+using JSCallback = std::function<void(JSResult)>;
+
+// An isolate that has compiled one JS resource and is reused across requests.
+// main() may be async: its Promise is settled by pump() from the event loop.
+class PooledIsolate {
+public:
+    // May return nullptr if the source fails to compile or has no main().
+    // watchdog enforces the limits' cpu_budget on every slice of JS the
+    // isolate runs. Overruns and timeouts are counted under resource.
+    static std::unique_ptr<PooledIsolate> create(const std::string &resource,
+                                                 const std::string &source,
+                                                 const FunctionLimits &limits,
+                                                 ExecutionWatchdog *watchdog);
+
+    ~PooledIsolate();
+
+    PooledIsolate(const PooledIsolate &other) = delete;
+    PooledIsolate& operator=(const PooledIsolate &other) = delete;
+
+    // Calls main(host), where host exposes request to the script. done runs
+    // immediately if main() returns a string or a settled Promise, and from a
+    // later pump() otherwise.
+    void call(const std::string &request, JSCallback done);
+
+    // Resolves expired host timers, runs microtasks and completes calls
+    // whose Promises have settled, then times out the calls past deadline.
+    // If the microtasks run out of budget, every pending call fails and the
+    // isolate is marked poisoned.
+    void pump();
+
+    // True while a call or a host timer is outstanding.
+    bool has_pending_work() const { return !pending_calls.empty() || !timers.empty(); }
+
+    // Runs GC work until deadline, which is in platform monotonic seconds.
+    // Returns true if V8 has no more idle work to do.
+    bool idle_notification(double deadline);
+
+    // Forces a full GC that also releases memory back to the system.
+    void low_memory_notification();
+
+    // Returns the number of bytes used by objects on the heap.
+    size_t used_heap_size();
+
+    const std::string& get_source() const { return source; }
+
+    v8::Isolate* get_isolate() const { return isolate; }
+
+    // When the last request finished.
+    std::chrono::steady_clock::time_point last_used;
+
+    // True once V8 reported there is no idle work left since last_used.
+    bool idle_work_done = true;
+
+    // True once the low memory notification was sent since last_used.
+    bool low_memory_done = true;
+
+    // cpu_budget applies to each call to main() and each pump(), and
+    // deadline bounds how long a call to main() may wait for its Promise
+    // to settle.
+    FunctionLimits limits;
+
+    // True once JS was terminated somewhere it cannot be attributed to one
+    // call. The isolate should be replaced.
+    bool poisoned = false;
+
+    // The resource's calls that ran out of CPU budget, and that timed out.
+    Counter &budget_overruns;
+    Counter &timeouts;
+
+private:
+    PooledIsolate(v8::Isolate *isolate, v8::ArrayBuffer::Allocator *allocator,
+                  const std::string &resource, const std::string &source,
+                  const FunctionLimits &limits, ExecutionWatchdog *watchdog)
+        : limits(limits),
+          budget_overruns(stats_counter("js_budget_overruns{resource=\"" + resource + "\"}")),
+          timeouts(stats_counter("js_timeouts{resource=\"" + resource + "\"}")),
+          isolate(isolate), allocator(allocator), source(source), watchdog(watchdog) {}
+
+    // A call to main() whose Promise has not settled yet.
+    struct PendingCall {
+        std::chrono::steady_clock::time_point deadline;
+        v8::Global<v8::Promise> promise;
+        v8::Global<v8::Object> host;
+        std::unique_ptr<HostInvocation> invocation;
+        JSCallback done;
+    };
+
+    // A Promise returned by sleep() that resolves at deadline.
+    struct Timer {
+        std::chrono::steady_clock::time_point deadline;
+        v8::Global<v8::Promise::Resolver> resolver;
+    };
+
+    // Implements sleep(ms), which returns a Promise resolved by the event loop.
+    static void sleep(const v8::FunctionCallbackInfo<v8::Value> &info);
+
+    // Converts a settled Promise or a plain value into main()'s result, and
+    // detaches the invocation's host object.
+    JSResult settle(v8::Local<v8::Value> value, v8::Local<v8::Object> host,
+                    const HostInvocation &invocation);
+
+    // Stops the watchdog. Returns true, and makes the isolate usable again,
+    // if the budget ran out.
+    bool disarm_watchdog();
+
+    v8::Isolate *isolate;
+    v8::ArrayBuffer::Allocator *allocator;
+    const std::string source;
+    ExecutionWatchdog *watchdog;
+    v8::Global<v8::Context> context;
+    v8::Global<v8::Function> main_func;
+    v8::Global<v8::FunctionTemplate> host_template;
+    std::vector<PendingCall> pending_calls;
+    std::vector<Timer> timers;
+};
+
+// Keeps one warm isolate per JS resource and moves GC work into the idle
+// windows between requests.
+class IsolatePool {
+public:
+    explicit IsolatePool(v8::Platform *platform) : platform(platform) {}
+
+    IsolatePool(const IsolatePool &other) = delete;
+    IsolatePool& operator=(const IsolatePool &other) = delete;
+
+    // Runs resource's main() on request, creating its isolate on first use
+    // and replacing it when source changes, under resource's limits: an
+    // async main() whose Promise has not settled after limits.deadline
+    // times out.
+    // done receives the result, possibly after later calls to pump().
+    void call(const std::string &resource, const std::string &source,
+              const FunctionLimits &limits, const std::string &request, JSCallback done);
+
+    // Drops resource's isolate. Calls already made still finish.
+    void evict(const std::string &resource);
+
+    // Drives async calls in every isolate. Call once per event loop turn.
+    void pump();
+
+    // Spends at most budget on GC for idle isolates and on rotating out
+    // isolates whose heaps grew too large. Call only when no request waits.
+    void run_idle_tasks(std::chrono::milliseconds budget);
+
+private:
+    PooledIsolate* get_or_create(const std::string &resource, const std::string &source,
+                                 const FunctionLimits &limits);
+
+    v8::Platform *platform;
+    ExecutionWatchdog watchdog;
+    std::map<std::string, std::unique_ptr<PooledIsolate>> isolates;
+
+    // Replaced isolates that still have calls outstanding.
+    std::vector<std::unique_ptr<PooledIsolate>> draining;
+};
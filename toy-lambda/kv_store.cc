@@ -0,0 +1,24 @@
+#include "kv_store.hh"
+
+using namespace std;
+
+KVStore& KVStore::instance() {
+    static KVStore store;
+    return store;
+}
+
+double KVStore::get(string_view key) {
+    lock_guard<mutex> guard(lock);
+    auto entry = values.find(key);
+    return entry == values.end() ? 0 : entry->second;
+}
+
+void KVStore::set(string_view key, double value) {
+    lock_guard<mutex> guard(lock);
+    auto entry = values.find(key);
+    if (entry == values.end()) {
+        values.emplace(key, value);
+    } else {
+        entry->second = value;
+    }
+}
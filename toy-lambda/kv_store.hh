@@ -0,0 +1,29 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// Numbers stored by key, shared by every function in the process: JS reaches
+// them through host.kvGet() and host.kvSet(), and NaCl through the kv_get
+// and kv_set host calls, which a HostCallRing may serve on its poller
+// thread. Safe to use from any thread.
+class KVStore {
+public:
+    static KVStore& instance();
+
+    KVStore(const KVStore &other) = delete;
+    KVStore& operator=(const KVStore &other) = delete;
+
+    // Returns the number stored under key, or 0.
+    double get(std::string_view key);
+
+    void set(std::string_view key, double value);
+
+private:
+    KVStore() = default;
+
+    std::mutex lock;
+    std::map<std::string, double, std::less<>> values;
+};
@@ -1,7 +1,7 @@
-#include <cstdlib>
-#include <string>
+#include <cstdio>
+#include "m80.h"
 
-char msg[100] = {0};
+M80_EXPORT_ABI_VERSION
 
 int fib(int n) {
     if (n < 2) {
@@ -10,8 +10,17 @@ int fib(int n) {
     return fib(n-2) + fib(n-1);
 }
 
-extern "C" const char* http_main() {
+int m80_main(const struct m80_request *, struct m80_response *response) {
     int x = fib(20);
-    sprintf(msg, "%d", x);
-    return msg;
+    int length = snprintf(response->data, response->capacity, "%d", x);
+    if (length < 0) {
+        return M80_ERROR;
+    }
+
+    response->length = length;
+    if (response->length >= response->capacity) {
+        response->length++;
+        return M80_BUFFER_TOO_SMALL;
+    }
+    return M80_OK;
 }
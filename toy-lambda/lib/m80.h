@@ -0,0 +1,61 @@
+/*
+ * The ABI between the server and native functions in lib/.
+ *
+ * A function exports its ABI version and an m80_main() entry point:
+ *
+ *     #include "m80.h"
+ *
+ *     M80_EXPORT_ABI_VERSION
+ *
+ *     int m80_main(const struct m80_request *request, struct m80_response *response) {
+ *         ...
+ *         return M80_OK;
+ *     }
+ *
+ * Functions without m80_abi_version are treated as version 1, whose entry
+ * point is `const char *http_main(void)`.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define M80_ABI_VERSION 2
+
+#ifdef __cplusplus
+#define M80_EXTERN_C extern "C"
+#else
+#define M80_EXTERN_C extern
+#endif
+
+/* The request being served. Owned by the host and valid only during the call. */
+struct m80_request {
+    /* The raw HTTP request. Not NUL-terminated. */
+    const char *data;
+    size_t length;
+};
+
+/* A host-owned buffer the function writes its response body into. */
+struct m80_response {
+    char *data;
+    size_t capacity;
+
+    /* Set by the function to the number of bytes written, or, when it
+     * returns M80_BUFFER_TOO_SMALL, to the number of bytes it needs. */
+    size_t length;
+};
+
+/* Return codes of m80_main(). */
+#define M80_OK 0
+#define M80_ERROR (-1)
+/* The host grows the buffer to response->length and calls again. */
+#define M80_BUFFER_TOO_SMALL (-2)
+
+typedef int (*m80_main_fn)(const struct m80_request *request, struct m80_response *response);
+
+M80_EXTERN_C const uint32_t m80_abi_version;
+
+M80_EXTERN_C int m80_main(const struct m80_request *request, struct m80_response *response);
+
+/* Defines m80_abi_version. Use exactly once per function. */
+#define M80_EXPORT_ABI_VERSION const uint32_t m80_abi_version = M80_ABI_VERSION;
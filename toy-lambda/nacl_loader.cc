@@ -1,111 +1,824 @@
-#include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <cstdio>
 #include <iostream>
-#include <set>
+#include <map>
+#include <utility>
+#include <vector>
+#include "dirty_pages.hh"
 #include "elfio/elfio.hpp"
+#include "host_call_ring.hh"
+#include "host_calls.hh"
 #include "nacl_loader.hh"
+#include "sandbox_switch.hh"
+#include "stats.hh"
 
 extern "C" {
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
 }
 
 using namespace std;
 
-std::unique_ptr<NaClContext> NaClContext::create_context(const string &file) {
+struct SandboxInvocation {
+    NaClContext *context;
+
+    // When the invocation is aborted, or the epoch for never.
+    chrono::steady_clock::time_point deadline;
+
+    // Instructions the invocation may execute before it is aborted, or 0
+    // for no limit, and those counted so far. Only counted while metered.
+    uint64_t instruction_budget = 0;
+    uint64_t instructions = 0;
+    bool metered = false;
+
+    // Set by the preemption signal's handler, when the invocation is
+    // aborted, and when it runs out of instructions.
+    atomic<bool> timed_out = false;
+    atomic<bool> exhausted = false;
+
+    // Set by the fault handler.
+    atomic<bool> faulted = false;
+};
+
+namespace {
+
+const unsigned long page_size = 4096;
+
+// The host-call table and the trampoline share the last page of the slot,
+// which is read and execute only. Stacks are carved downwards from the page
+// below it, each with an inaccessible guard page below, and the heap ends
+// below the guard page of the last one.
+const unsigned long trampoline_offset = (0xfffffffful / 32ul) * 32ul - 64;
+const unsigned long stacks_top = trampoline_offset / page_size * page_size;
+const unsigned long stack_stride = nacl_stack_size + page_size;
+const unsigned long heap_limit = stacks_top - nacl_max_stacks * stack_stride;
+
+static_assert(nacl_host_call_table == trampoline_offset / page_size * page_size);
+static_assert(nacl_host_call_capacity * nacl_host_call_entry_size <= trampoline_offset % page_size);
+
+Histogram &reset_us = stats_histogram("nacl_reset_us");
+Histogram &reset_pages = stats_histogram("nacl_reset_pages");
+Counter &stack_exhausted = stats_counter("nacl_stack_exhausted");
+Counter &timeouts = stats_counter("nacl_timeouts");
+Counter &faults = stats_counter("nacl_faults");
+Counter &budget_exhausted = stats_counter("nacl_instruction_budget_exhausted");
+Histogram &invocation_instructions = stats_histogram("nacl_instructions");
+
+// How soon the preemption signal comes again when it finds the thread in
+// host code, such as a host call, past the deadline or the budget.
+const chrono::milliseconds preemption_retry(1);
+
+// The invocation this thread is running.
+thread_local SandboxInvocation *current_invocation = nullptr;
+
+thread_local bool last_timed_out = false;
+thread_local bool last_faulted = false;
+thread_local optional<uint64_t> last_instructions;
+
+int preemption_signal() {
+    return SIGRTMIN + 1;
+}
+
+void on_preemption(int signal, siginfo_t *info, void *context);
+void on_fault(int signal, siginfo_t *info, void *context);
+
+// The SIGSEGV and SIGBUS actions from before on_fault() was installed,
+// for faults that are not sandboxed code's.
+struct sigaction previous_segv_action;
+struct sigaction previous_bus_action;
+
+// Installs the handlers of the preemption signal, SIGSEGV and SIGBUS, once
+// for the process, and this thread's stack for handling them. Sandbox
+// stacks are no place for a signal frame: sandboxed code can read them,
+// and may have left its stack pointer anywhere in its memory.
+class SignalStack {
+public:
+    ~SignalStack() {
+        if (stack != MAP_FAILED) {
+            stack_t disabled = {.ss_sp = nullptr, .ss_flags = SS_DISABLE, .ss_size = 0};
+            sigaltstack(&disabled, nullptr);
+            munmap(stack, stack_size);
+        }
+    }
+
+    // Returns false on failure. Only the first call on a thread does
+    // anything.
+    bool install() {
+        if (!tried) {
+            tried = true;
+            installed = set_up();
+        }
+        return installed;
+    }
+
+private:
+    static const size_t stack_size = 64 * 1024;
+
+    bool set_up();
+
+    bool tried = false;
+    bool installed = false;
+    void *stack = MAP_FAILED;
+};
+
+thread_local SignalStack signal_stack;
+
+// The thread's deadline timer, which signals the thread itself.
+class DeadlineTimer {
+public:
+    ~DeadlineTimer() {
+        if (created) {
+            timer_delete(timer);
+        }
+    }
+
+    // Delivers the signal at deadline, or earlier if it is already due
+    // earlier: setting the timer costs a system call, and deadlines mostly
+    // come later than the last one, so the handler re-arms the timer when
+    // it fires early instead. Returns false if the thread's timer cannot be
+    // created.
+    bool arm(chrono::steady_clock::time_point deadline);
+
+    // Called by the handler, since the timer is no longer set.
+    void fired() { armed = {}; }
+
+private:
+    bool create();
+
+    bool created = false;
+    bool failed = false;
+    timer_t timer;
+
+    // When the timer is set to fire, or zero if it is not set.
+    chrono::steady_clock::time_point armed;
+};
+
+thread_local DeadlineTimer deadline_timer;
+
+// Counts the instructions the thread retires in user mode while a metered
+// invocation runs, with a hardware performance counter, and delivers the
+// preemption signal when the invocation's budget runs out. The count covers
+// the host calls the invocation makes, but not the time it is parked.
+class InstructionMeter {
+public:
+    ~InstructionMeter() {
+        if (counter >= 0) {
+            close(counter);
+        }
+    }
+
+    // Whether this machine exposes an instruction counter to user mode. Many
+    // virtual machines do not, and then no budget can be enforced.
+    static bool supported();
+
+    // Counts for invocation until stop(). Returns false if the thread's
+    // counter cannot be opened, as where the CPU's counters are not
+    // exposed, such as in many virtual machines.
+    bool start(SandboxInvocation &invocation);
+
+    // Adds what was counted to invocation, if it is the one counting.
+    void stop(SandboxInvocation &invocation);
+
+    bool counting(const SandboxInvocation *invocation) const {
+        return invocation != nullptr && running == invocation;
+    }
+
+private:
+    // Opens a disabled counter of this thread's user-mode instructions.
+    // Returns -1 on failure.
+    static int open_counter();
+
+    bool open();
+
+    int counter = -1;
+    bool failed = false;
+    SandboxInvocation *running = nullptr;
+};
+
+thread_local InstructionMeter instruction_meter;
+
+// Sends sandboxed code running past its invocation's deadline, or out of
+// instructions, to sandbox_exit. Comes again shortly if the thread is in
+// host code.
+void on_preemption(int signal, siginfo_t *info, void *context) {
+    SandboxInvocation *invocation = current_invocation;
+    if (info->si_code == SI_TIMER) {
+        deadline_timer.fired();
+    } else if (instruction_meter.counting(invocation)) {
+        invocation->exhausted.store(true, memory_order_relaxed);
+    }
+    if (invocation == nullptr) {
+        return;
+    }
+
+    bool has_deadline = invocation->deadline != chrono::steady_clock::time_point();
+    auto now = chrono::steady_clock::now();
+    if (!invocation->exhausted.load(memory_order_relaxed) &&
+        (!has_deadline || now < invocation->deadline)) {
+        // Armed for an earlier deadline, or for an invocation that has
+        // since finished.
+        if (has_deadline) {
+            deadline_timer.arm(invocation->deadline);
+        }
+        return;
+    }
+
+    greg_t &rip = ((ucontext_t*) context)->uc_mcontext.gregs[REG_RIP];
+    if (invocation->context->offset_of((const void*) rip).has_value()) {
+        invocation->timed_out.store(true, memory_order_relaxed);
+        rip = (greg_t) &sandbox_exit;
+    } else {
+        deadline_timer.arm(now + preemption_retry);
+    }
+}
+
+// Sends sandboxed code that faults, such as by touching an inaccessible
+// page of its slot, to sandbox_exit, and the host-call routine when the
+// sandbox stack it returns through faults. No host frame is live in either
+// case. Other faults are the server's own.
+void on_fault(int signal, siginfo_t *info, void *context) {
+    SandboxInvocation *invocation = current_invocation;
+    greg_t &rip = ((ucontext_t*) context)->uc_mcontext.gregs[REG_RIP];
+    bool in_sandbox = invocation != nullptr &&
+        invocation->context->offset_of((const void*) rip).has_value();
+    bool in_host_call = invocation != nullptr &&
+        rip >= (greg_t) &sandbox_host_call && rip < (greg_t) sandbox_host_call_end &&
+        invocation->context->offset_of(info->si_addr).has_value();
+    if (in_sandbox || in_host_call) {
+        invocation->faulted.store(true, memory_order_relaxed);
+        rip = (greg_t) &sandbox_exit;
+        return;
+    }
+
+    struct sigaction &previous = signal == SIGSEGV ? previous_segv_action : previous_bus_action;
+    if (previous.sa_flags & SA_SIGINFO) {
+        previous.sa_sigaction(signal, info, context);
+    } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+        previous.sa_handler(signal);
+    } else {
+        // The faulting instruction runs again and takes the default action.
+        struct sigaction default_action = {};
+        default_action.sa_handler = SIG_DFL;
+        sigaction(signal, &default_action, nullptr);
+    }
+}
+
+bool SignalStack::set_up() {
+    static once_flag handlers_installed;
+    call_once(handlers_installed, [] {
+        struct sigaction action = {};
+        action.sa_sigaction = on_preemption;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(preemption_signal(), &action, nullptr) != 0) {
+            perror("sigaction()");
+        }
+
+        action.sa_sigaction = on_fault;
+        if (sigaction(SIGSEGV, &action, &previous_segv_action) != 0 ||
+            sigaction(SIGBUS, &action, &previous_bus_action) != 0) {
+            perror("sigaction()");
+        }
+    });
+
+    stack_t current;
+    if (sigaltstack(nullptr, &current) != 0) {
+        perror("sigaltstack()");
+        return false;
+    }
+    if ((current.ss_flags & SS_DISABLE) == 0) {
+        return true;
+    }
+    stack = mmap(nullptr, stack_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    stack_t alternate = {.ss_sp = stack, .ss_flags = 0, .ss_size = stack_size};
+    if (stack == MAP_FAILED || sigaltstack(&alternate, nullptr) != 0) {
+        perror("sigaltstack()");
+        return false;
+    }
+    return true;
+}
+
+bool DeadlineTimer::create() {
+    if (!signal_stack.install()) {
+        return false;
+    }
+
+    struct sigevent event = {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = preemption_signal();
+    event._sigev_un._tid = gettid();
+    if (timer_create(CLOCK_MONOTONIC, &event, &timer) != 0) {
+        perror("timer_create()");
+        return false;
+    }
+    created = true;
+    return true;
+}
+
+bool DeadlineTimer::arm(chrono::steady_clock::time_point deadline) {
+    if (!created && !failed) {
+        failed = !create();
+    }
+    if (!created) {
+        return false;
+    }
+    if (armed != chrono::steady_clock::time_point() && armed <= deadline) {
+        return true;
+    }
+
+    // steady_clock is CLOCK_MONOTONIC.
+    auto since_epoch = chrono::duration_cast<chrono::nanoseconds>(deadline.time_since_epoch());
+    struct itimerspec expiry = {};
+    expiry.it_value.tv_sec = since_epoch.count() / 1000000000;
+    expiry.it_value.tv_nsec = since_epoch.count() % 1000000000;
+    if (timer_settime(timer, TIMER_ABSTIME, &expiry, nullptr) != 0) {
+        return false;
+    }
+    armed = deadline;
+    return true;
+}
+
+bool InstructionMeter::supported() {
+    static const bool counter_available = [] {
+        int counter = open_counter();
+        if (counter < 0) {
+            perror("perf_event_open()");
+            return false;
+        }
+        close(counter);
+        return true;
+    }();
+    return counter_available;
+}
+
+int InstructionMeter::open_counter() {
+    struct perf_event_attr attributes = {};
+    attributes.size = sizeof(attributes);
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attributes.disabled = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    attributes.sample_period = 1;
+    attributes.wakeup_events = 1;
+    return syscall(SYS_perf_event_open, &attributes, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+bool InstructionMeter::open() {
+    if (!signal_stack.install()) {
+        return false;
+    }
+
+    counter = open_counter();
+    if (counter < 0) {
+        perror("perf_event_open()");
+        return false;
+    }
+
+    // The counter signals this thread when it overflows.
+    struct f_owner_ex owner = {.type = F_OWNER_TID, .pid = gettid()};
+    if (fcntl(counter, F_SETOWN_EX, &owner) != 0 ||
+        fcntl(counter, F_SETSIG, preemption_signal()) != 0 ||
+        fcntl(counter, F_SETFL, O_ASYNC) != 0) {
+        perror("fcntl()");
+        close(counter);
+        counter = -1;
+        return false;
+    }
+    return true;
+}
+
+bool InstructionMeter::start(SandboxInvocation &invocation) {
+    if (counter < 0 && !failed) {
+        failed = !open();
+    }
+    if (counter < 0) {
+        return false;
+    }
+
+    // Overflows when the rest of the budget is used. Setting the period
+    // restarts it.
+    uint64_t remaining = invocation.instruction_budget -
+        min(invocation.instructions, invocation.instruction_budget - 1);
+    if (ioctl(counter, PERF_EVENT_IOC_RESET, 0) != 0 ||
+        ioctl(counter, PERF_EVENT_IOC_PERIOD, &remaining) != 0) {
+        perror("ioctl()");
+        return false;
+    }
+    running = &invocation;
+    invocation.metered = true;
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    return true;
+}
+
+void InstructionMeter::stop(SandboxInvocation &invocation) {
+    if (running != &invocation) {
+        return;
+    }
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    running = nullptr;
+    uint64_t count;
+    if (read(counter, &count, sizeof(count)) == sizeof(count)) {
+        invocation.instructions += count;
+    }
+}
+unsigned long page_ceil(unsigned long value) {
+    return (value + page_size - 1) / page_size * page_size;
+}
+
+// The end of the given stack.
+unsigned long stack_top(unsigned int stack) {
+    return stacks_top - stack * stack_stride;
+}
+
+}
+
+std::unique_ptr<NaClContext> NaClContext::create_context(const string &file,
+                                                         size_t memory_limit,
+                                                         chrono::milliseconds deadline,
+                                                         uint64_t instruction_budget) {
+    // An unenforced budget would leave an invocation without a bound when
+    // it has no deadline either.
+    if (instruction_budget > 0 && !InstructionMeter::supported()) {
+        cerr << "Unable to meter " << file << ": this machine exposes no instruction counter."
+             << endl;
+        return nullptr;
+    }
+
+    // Lazily, so only the headers and the symbol table are read.
     ELFIO::elfio reader;
-    if (!reader.load(file)) {
+    if (!reader.load(file, true)) {
         cerr << "Can't find or process ELF file " << file << endl;
         return nullptr;
     }
 
-    char *executable_space =
-        (char*) mmap((void*) (0xffffffffUL / 4096UL * 4096UL + 4096UL), 0xffffffff,
-                     PROT_READ | PROT_WRITE | PROT_EXEC, 
-                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
-    if (executable_space == MAP_FAILED) {
-        perror("mmap()");
+    map<string, SandboxFunction> functions;
+    for (const auto &section : reader.sections) {
+        if (section->get_type() != ELFIO::SHT_SYMTAB) {
+            continue;
+        }
+        const ELFIO::symbol_section_accessor symbols(reader, section.get());
+        for (unsigned int j = 0; j < symbols.get_symbols_num(); ++j) {
+            std::string name;
+            ELFIO::Elf64_Addr value;
+            ELFIO::Elf_Xword size;
+            unsigned char bind;
+            unsigned char type;
+            ELFIO::Elf_Half section_index;
+            unsigned char other;
+            if (!symbols.get_symbol(j, name, value, size, bind,
+                                    type, section_index, other)) {
+                continue;
+            }
+            if (type == ELFIO::STT_FUNC && bind == ELFIO::STB_GLOBAL && value != 0 &&
+                value < sandbox_slot_size) {
+                functions[name] = SandboxFunction{(uint32_t) value};
+            }
+        }
+    }
+
+    auto entry = functions.find("f");
+    if (entry == functions.end()) {
+        cerr << "Error: function f() is missing." << endl;
         return nullptr;
     }
 
-    const unsigned long trampoline_offset = (0xfffffffful / 32ul) * 32ul - 64;
-
-    char* (*f)(void) = nullptr;
-    for (int i = 0; i < reader.sections.size(); i++) {
-        ELFIO::section *pspec = reader.sections[i];
-        if (pspec->get_type() == ELFIO::SHT_SYMTAB ) {
-            const ELFIO::symbol_section_accessor symbols(reader, pspec);
-            for (unsigned int j = 0; j < symbols.get_symbols_num(); ++j) {
-                std::string name;
-                ELFIO::Elf64_Addr value;
-                ELFIO::Elf_Xword size;
-                unsigned char bind;
-                unsigned char type;
-                ELFIO::Elf_Half section_index;
-                unsigned char other;
-                symbols.get_symbol(j, name, value, size, bind,
-                                   type, section_index, other);
-                if (name == "f") {
-                    f = (char*(*)(void)) (executable_space + value);
-                }
-            }
+    vector<SandboxSegment> segments;
+    for (const auto &segment : reader.segments) {
+        if (segment->get_type() != ELFIO::PT_LOAD) {
+            continue;
         }
 
-        set<string> excluded_sections = {".shstrtab", ".symtab", ".strtab", ".comment", ".init", ".rela.text"};
-        if (excluded_sections.find(pspec->get_name()) == excluded_sections.end()) {
-            const char *data = pspec->get_data();
-            if (data != NULL) {
-                assert(pspec->get_address() + pspec->get_size() < trampoline_offset);
-                memcpy(executable_space + pspec->get_address(), data, pspec->get_size());
-            }
+        SandboxSegment loadable = {
+            .address = segment->get_virtual_address(),
+            .memory_size = segment->get_memory_size(),
+            .file_offset = segment->get_offset(),
+            .file_size = segment->get_file_size(),
+            .protection = (segment->get_flags() & ELFIO::PF_R ? PROT_READ : 0) |
+                (segment->get_flags() & ELFIO::PF_W ? PROT_WRITE : 0) |
+                (segment->get_flags() & ELFIO::PF_X ? PROT_EXEC : 0),
+        };
+        if (loadable.file_size > loadable.memory_size ||
+            loadable.address + loadable.memory_size > heap_limit ||
+            loadable.address % page_size != loadable.file_offset % page_size) {
+            cerr << "Error: " << file << " has a segment that cannot be mapped at "
+                 << hex << loadable.address << dec << "." << endl;
+            return nullptr;
         }
+        segments.push_back(loadable);
     }
 
-    if (f == nullptr) {
-        cerr << "Error: function f() is missing." << endl;
+    // The last page starts with the host-call table and ends with the
+    // trampoline. The rest traps.
+    string host_page = HostCallTable::instance().code();
+    host_page.resize(trampoline_offset % page_size, '\xcc');
+    host_page.append(sandbox_trampoline_code());
+
+    shared_ptr<SandboxImage> image = SandboxImage::share(file, segments, host_page,
+                                                         nacl_host_call_table);
+    if (image == nullptr) {
+        return nullptr;
+    }
+
+    unsigned long committed = image->writable_size() + nacl_stack_size;
+    if (committed > memory_limit) {
+        cerr << "Error: " << file << " needs " << committed << " bytes for its data and stack, "
+             << "more than its memory limit of " << memory_limit << "." << endl;
+        return nullptr;
+    }
+
+    char *executable_space = SandboxSlotAllocator::instance().allocate();
+    if (executable_space == nullptr) {
+        cerr << "Unable to allocate a sandbox slot for " << file << endl;
         return nullptr;
     }
+    if (!image->map(executable_space)) {
+        SandboxSlotAllocator::instance().release(executable_space);
+        return nullptr;
+    }
+
+    Gauge &committed_gauge = stats_gauge("nacl_committed_bytes{function=\"" + file + "\"}");
+    auto context = make_unique<NaClContext>(executable_space, entry->second, std::move(functions),
+                                            std::move(image), memory_limit, deadline,
+                                            instruction_budget, committed_gauge);
+    context->heap_break = context->image->end();
+    context->committed = context->image->writable_size();
+    committed_gauge.add(context->committed);
+
+    // The first stack, which a sandbox called from one thread at a time
+    // always reuses.
+    optional<unsigned int> stack = context->acquire_stack();
+    if (!stack.has_value()) {
+        return nullptr;
+    }
+    context->release_stack(*stack);
+    return context;
+}
 
-    char trampoline_data[] = 
-        "\x55"
-        "\x48\x89\xe5"
-        "\x90\x90\x90\x90"
-        "\x90\x90\x90\x90"
-        "\x90\x90\x90\x90"
-        "\x90\x90\x90\x90"
-        "\x90\x90\x90\x90"
-        "\x90\x90\x90\x90"
-        "\xff\x54\x24\x10"
-        "\x5d"
-        "\xc3";
-    char *trampoline_addr = executable_space + trampoline_offset;
-    memcpy(trampoline_addr, trampoline_data, sizeof(trampoline_data));
-
-    return make_unique<NaClContext>(executable_space, (char*) f);
-}
-
-std::optional<std::string> NaClContext::call() {
-    const unsigned long trampoline_offset = (0xfffffffful / 32ul) * 32ul - 64;
-    char *stack_top = trampoline_offset - 16 + this->executable_space_start;
-    char *trampoline_addr = this->executable_space_start + trampoline_offset;;
-    char *result = nullptr;
-    __asm__ volatile(
-        "movq %1, %%r15\n\t"
-        "pushq %%rbp\n\t"
-        "movq %%rsp, %%rbp\n\t"
-        "movq %3, %%rsp\n\t"
-        "pushq %2\n\t"
-        "callq *%4\n\t"
-        "movq %%rax, %0\n\t"
-        "movq %%rbp, %%rsp\n\t"
-        "popq %%rbp\n\t"
-        : "=r"(result)
-        : "r"(this->executable_space_start), "r"(f), "r"(stack_top), "r"(trampoline_addr)
-        : "%r15"
-    );
-
-    if (result == nullptr) {
+NaClContext::~NaClContext() {
+    HostCallPoller::instance().detach(*this);
+    // Dropping pages of the image mapping would bring the image back, so
+    // hand the slot back as plain anonymous memory.
+    mmap(executable_space_start, sandbox_slot_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    SandboxSlotAllocator::instance().release(executable_space_start);
+    committed_gauge.add(-(int64_t) committed);
+}
+
+std::optional<uint32_t> NaClContext::sbrk(int32_t increment) {
+    lock_guard<mutex> guard(memory_lock);
+    unsigned long old_break = heap_break;
+    long new_break = (long) heap_break + increment;
+    if (new_break < (long) image->end() || new_break > (long) heap_limit ||
+        (heap_pinned && increment < 0) || !move_break(new_break)) {
         return {};
     }
+    return old_break;
+}
+
+bool NaClContext::move_break(unsigned long new_break) {
+    unsigned long old_end = page_ceil(heap_break);
+    unsigned long new_end = page_ceil(new_break);
+    if (new_end > old_end) {
+        if (committed + (new_end - old_end) > memory_limit) {
+            return false;
+        }
+        if (mprotect(executable_space_start + old_end, new_end - old_end,
+                     PROT_READ | PROT_WRITE) != 0) {
+            perror("mprotect()");
+            return false;
+        }
+    } else if (new_end < old_end) {
+        // Released pages must read as zero if the heap grows over them again.
+        if (madvise(executable_space_start + new_end, old_end - new_end, MADV_DONTNEED) != 0 ||
+            mprotect(executable_space_start + new_end, old_end - new_end, PROT_NONE) != 0) {
+            perror("shrinking the heap");
+            return false;
+        }
+    }
+
+    committed += new_end - old_end;
+    committed_gauge.add((int64_t) new_end - (int64_t) old_end);
+    heap_break = new_break;
+    return true;
+}
+
+void NaClContext::reset() {
+    auto start = chrono::steady_clock::now();
 
-    return std::string(result + (unsigned long) executable_space_start);
-}
\ No newline at end of file
+    // An empty heap, as create_context() left it. The ring is in the memory
+    // about to be dropped.
+    HostCallPoller::instance().detach(*this);
+    {
+        lock_guard<mutex> guard(memory_lock);
+        move_break(image->end());
+    }
+
+    // On a private file mapping, MADV_DONTNEED discards our copies of the
+    // pages, and later accesses read the image again. Pages written
+    // outside the loaded image come back zeroed. Pages that were only read
+    // still map the image, so they are left alone and stay faulted in.
+    if (written_page_scan_supported() &&
+        find_written_pages(executable_space_start, sandbox_slot_size, written_pages)) {
+        unsigned long pages = 0;
+        for (auto [page, length] : written_pages) {
+            if (madvise(page, length, MADV_DONTNEED) != 0) {
+                perror("madvise()");
+            }
+            pages += length / page_size;
+        }
+        reset_pages.record(pages);
+    } else {
+        if (madvise(executable_space_start, sandbox_slot_size, MADV_DONTNEED) != 0) {
+            perror("madvise()");
+        }
+    }
+
+    poisoned = false;
+    reset_us.record(chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now() - start).count());
+}
+
+NaClContext& NaClContext::current() {
+    return *current_invocation->context;
+}
+
+SandboxInvocation* NaClContext::exchange_invocation(SandboxInvocation *invocation) {
+    SandboxInvocation *replaced = current_invocation;
+    if (replaced != nullptr) {
+        instruction_meter.stop(*replaced);
+    }
+    current_invocation = invocation;
+    if (invocation == nullptr) {
+        return replaced;
+    }
+    if (invocation->deadline != chrono::steady_clock::time_point()) {
+        deadline_timer.arm(invocation->deadline);
+    }
+    if (invocation->instruction_budget > 0) {
+        instruction_meter.start(*invocation);
+    }
+    return replaced;
+}
+
+bool NaClContext::last_call_timed_out() {
+    return last_timed_out;
+}
+
+bool NaClContext::last_call_faulted() {
+    return last_faulted;
+}
+
+optional<uint64_t> NaClContext::last_call_instructions() {
+    return last_instructions;
+}
+
+optional<SandboxFunction> NaClContext::function(const string &name) const {
+    auto function = functions.find(name);
+    if (function == functions.end()) {
+        return {};
+    }
+    return function->second;
+}
+
+optional<string_view> NaClContext::string_at(uint32_t offset) const {
+    unsigned long start = offset;
+    while (true) {
+        unsigned long end = accessible_end(start, PROT_READ);
+        if (end <= start) {
+            return {};
+        }
+        const char *nul = (const char*) memchr(executable_space_start + start, '\0', end - start);
+        if (nul != nullptr) {
+            return string_view(executable_space_start + offset, nul - (executable_space_start + offset));
+        }
+        start = end;
+    }
+}
+
+unsigned long NaClContext::accessible_end(unsigned long offset, int protection) const {
+    if ((protection & PROT_EXEC) == 0) {
+        unsigned int stack = (stacks_top - 1 - offset) / stack_stride;
+        if (offset >= heap_limit && offset < stacks_top && stack < stack_count &&
+            offset >= stack_top(stack) - nacl_stack_size) {
+            return stack_top(stack);
+        }
+        if (offset >= image->end() && offset < page_ceil(heap_break)) {
+            return page_ceil(heap_break);
+        }
+    }
+    return image->accessible_end(offset, protection);
+}
+
+bool NaClContext::accessible(unsigned long offset, unsigned long size, int protection) const {
+    unsigned long end = offset + size;
+    while (offset < end) {
+        unsigned long next = accessible_end(offset, protection);
+        if (next <= offset) {
+            return false;
+        }
+        offset = next;
+    }
+    return true;
+}
+
+optional<unsigned int> NaClContext::acquire_stack() {
+    lock_guard<mutex> guard(memory_lock);
+    if (!free_stacks.empty()) {
+        unsigned int stack = free_stacks.back();
+        free_stacks.pop_back();
+        return stack;
+    }
+
+    unsigned int stack = stack_count;
+    if (stack == nacl_max_stacks || committed + nacl_stack_size > memory_limit) {
+        return {};
+    }
+    if (mprotect(executable_space_start + stack_top(stack) - nacl_stack_size, nacl_stack_size,
+                 PROT_READ | PROT_WRITE) != 0) {
+        perror("mprotect()");
+        return {};
+    }
+    committed += nacl_stack_size;
+    committed_gauge.add(nacl_stack_size);
+    stack_count = stack + 1;
+    return stack;
+}
+
+void NaClContext::release_stack(unsigned int stack) {
+    lock_guard<mutex> guard(memory_lock);
+    free_stacks.push_back(stack);
+}
+
+optional<uint64_t> NaClContext::enter(SandboxFunction function,
+                                      const array<uint64_t, 6> &registers) {
+    last_timed_out = false;
+    last_faulted = false;
+    last_instructions.reset();
+    if (poisoned) {
+        return {};
+    }
+    // Without it, a fault in sandboxed code takes the server down.
+    signal_stack.install();
+
+    optional<unsigned int> stack = acquire_stack();
+    if (!stack.has_value()) {
+        stack_exhausted.add();
+        return {};
+    }
+
+    SandboxInvocation invocation = {.context = this, .instruction_budget = instruction_budget};
+    if (deadline.count() > 0) {
+        invocation.deadline = chrono::steady_clock::now() + deadline;
+    }
+    SandboxInvocation *caller = exchange_invocation(&invocation);
+    if (instruction_budget > 0 && !invocation.metered) {
+        exchange_invocation(caller);
+        release_stack(*stack);
+        return {};
+    }
+    uint64_t result = sandbox_enter(executable_space_start, executable_space_start + trampoline_offset,
+                                    executable_space_start + function.offset,
+                                    executable_space_start + stack_top(*stack) - 16,
+                                    registers.data());
+    exchange_invocation(caller);
+    release_stack(*stack);
+    if (invocation.metered) {
+        last_instructions = invocation.instructions;
+        invocation_instructions.record(invocation.instructions);
+    }
+
+    // Whatever the aborted code was doing, such as updating its allocator,
+    // is left half done in the sandbox's memory until the next reset(), so
+    // no later or concurrent invocation's result can be trusted.
+    if (invocation.faulted.load(memory_order_relaxed)) {
+        last_faulted = true;
+        poisoned = true;
+        faults.add();
+        return {};
+    }
+    if (invocation.timed_out.load(memory_order_relaxed)) {
+        last_timed_out = true;
+        poisoned = true;
+        if (invocation.exhausted.load(memory_order_relaxed)) {
+            budget_exhausted.add();
+        } else {
+            timeouts.add();
+        }
+        return {};
+    }
+    if (poisoned) {
+        return {};
+    }
+    return result;
+}
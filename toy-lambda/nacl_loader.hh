@@ -1,33 +1,393 @@
 #pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <concepts>
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <span>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "sandbox_image.hh"
+#include "sandbox_slots.hh"
+#include "stats.hh"
 
 extern "C" {
 #include <sys/mman.h>
 }
 
-const unsigned long executable_space_size = 0xffffffffUL;
+// The stack each invocation of a sandbox gets, and how many invocations of
+// one sandbox may run at once.
+const unsigned long nacl_stack_size = 1UL << 20;
+const unsigned int nacl_max_stacks = 16;
+
+// A global function of a sandboxed binary, as an offset into its sandbox.
+struct SandboxFunction {
+    uint32_t offset;
+};
+
+class NaClContext;
+
+// What a thread is running in a sandbox. Only nacl_loader.cc looks inside.
+struct SandboxInvocation;
+
+// How a parameter type of a sandboxed function is passed. Integers and
+// enums take one register. A std::span of sandbox memory takes two: a
+// 32-bit sandbox pointer and an element count.
+template <typename T>
+struct SandboxArgument;
+
+// How a sandboxed function's result becomes a host value. See
+// NaClContext::call().
+template <typename T>
+struct SandboxResult;
+
+template <typename Signature>
+struct SandboxCall;
 
 class NaClContext {
 public:
-    std::optional<std::string> call();
+    // Calls the sandboxed function f, which has the C signature Signature,
+    // such as call<std::string_view(int, std::span<char>)>(n, buffer).
+    // Marshalling is generated for the signature at compile time, and
+    // nothing is copied. Parameters take at most six registers, as
+    // SandboxArgument describes. Integer and enum results are returned
+    // as is. A std::string_view result views the NUL-terminated string at
+    // the sandbox pointer the function returns. Returns nothing if a span
+    // argument or the returned string is not within the sandbox's
+    // accessible memory, or the returned pointer is null, or every stack
+    // is in use, or the call ran past its deadline or instruction budget, or
+    // faulted, or the sandbox is poisoned; a void function returns whether
+    // it completed. Views and spans of sandbox memory are only valid until
+    // reset().
+    //
+    // Any number of threads may call into one sandbox at once, sharing its
+    // code, data and heap. Each invocation runs on a stack of its own,
+    // taken from a pool that grows on demand up to nacl_max_stacks, within
+    // the memory limit.
+    //
+    // A SIGSEGV or SIGBUS in sandboxed code, such as from touching the
+    // inaccessible pages around its data, heap and stacks, aborts the
+    // invocation rather than the server, so those pages serve as bounds
+    // checks. So is a fault on the sandbox's stack as a host call returns
+    // through it. Faults in host functions themselves are not contained:
+    // unwinding their frames would skip their destructors.
+    //
+    // An invocation aborted for a fault, its deadline or its instruction
+    // budget poisons the sandbox: its memory may be left inconsistent, so
+    // calls fail until reset(), including those that were running
+    // alongside it when they return.
+    template <typename Signature, typename... Params>
+    auto call(Params&&... params) {
+        return invoke<Signature>(entry, std::forward<Params>(params)...);
+    }
+
+    // Like call(), but calls function instead of f.
+    template <typename Signature, typename... Params>
+    auto invoke(SandboxFunction function, Params&&... params) {
+        return SandboxCall<Signature>::invoke(*this, function, std::forward<Params>(params)...);
+    }
+
+    // Returns the global function called name, if the binary has one.
+    std::optional<SandboxFunction> function(const std::string &name) const;
 
-    // May return nullptr if something fails.
-    static std::unique_ptr<NaClContext> create_context(const std::string &executable);
+    // Returns count Ts of sandbox memory at offset, if all of them are
+    // accessible, and writable unless T is const.
+    template <typename T>
+    std::optional<std::span<T>> span_at(uint32_t offset, size_t count) const;
 
-    ~NaClContext() {
-        munmap(executable_space_start, executable_space_size);
+    // Returns the NUL-terminated string of sandbox memory at offset, if all
+    // of it is accessible.
+    std::optional<std::string_view> string_at(uint32_t offset) const;
+
+    // Returns the sandbox offset of host memory, if it is in the sandbox.
+    std::optional<uint32_t> offset_of(const void *address) const {
+        if (address < executable_space_start ||
+            address >= executable_space_start + sandbox_slot_size) {
+            return {};
+        }
+        return (const char*) address - executable_space_start;
     }
 
-    NaClContext(char *executable_space_start, char *f) :
-        executable_space_start(executable_space_start), f(f) {}
+    // Restores the sandbox to its state right after create_context(), so no
+    // state leaks between invocations. Only the pages written since the last
+    // reset are dropped, so its cost grows with what the call wrote rather
+    // than with what it read. No invocation may be running. Stacks stay in
+    // the pool. Clears any poisoning.
+    void reset();
+
+    // Moves the heap's break by increment bytes and returns its old offset.
+    // The heap starts at the first page after the binary's segments, and
+    // pages are committed as the break passes them. Returns nothing if the
+    // heap would pass the memory limit, its start or the stack. Sandboxed
+    // code calls this through the sbrk host call.
+    std::optional<uint32_t> sbrk(int32_t increment);
+
+    // While the heap is pinned, sbrk() does not shrink it, so host calls
+    // served on other threads can go on reading it.
+    void pin_heap(bool pinned) { heap_pinned = pinned; }
+
+    // The context whose sandboxed code this thread is running. Only valid
+    // within host calls.
+    static NaClContext& current();
+
+    // Makes invocation the one this thread is running, so current() returns
+    // its context and its deadline applies, and returns the one it replaces.
+    // For switching between fibers.
+    static SandboxInvocation* exchange_invocation(SandboxInvocation *invocation);
+
+    // Whether the calling thread's last call() or invoke() was aborted at
+    // its deadline or for running out of instructions.
+    static bool last_call_timed_out();
+
+    // The instructions the calling thread's last call() or invoke()
+    // executed, host calls included, if it was metered.
+    static std::optional<uint64_t> last_call_instructions();
+
+    // Whether the calling thread's last call() or invoke() was aborted by a
+    // fault.
+    static bool last_call_faulted();
+
+    // Bytes of the slot that are writable: data, bss, stacks and heap.
+    unsigned long committed_bytes() const { return committed; }
+
+    // May return nullptr if something fails, including the binary's data and
+    // stack not fitting memory_limit bytes. Each context gets a slot of its
+    // own from SandboxSlotAllocator, so any number of them can coexist. The
+    // slot is reserved inaccessible, apart from what the binary and stack
+    // need. An invocation still in sandboxed code deadline after it started,
+    // time parked in host calls included, is aborted by a timer signal; a
+    // zero deadline lets invocations run forever. A nonzero
+    // instruction_budget meters invocations, counting the instructions they
+    // execute with the CPU's performance counters, and aborts those that
+    // execute more. Creating a metered context fails where the CPU's
+    // counters are not exposed, and an invocation whose counter cannot be
+    // started fails without running.
+    static std::unique_ptr<NaClContext> create_context(const std::string &executable,
+                                                       size_t memory_limit,
+                                                       std::chrono::milliseconds deadline,
+                                                       uint64_t instruction_budget);
+
+    ~NaClContext();
+
+    NaClContext(char *executable_space_start, SandboxFunction entry,
+                std::map<std::string, SandboxFunction> functions,
+                std::shared_ptr<SandboxImage> image, size_t memory_limit,
+                std::chrono::milliseconds deadline, uint64_t instruction_budget,
+                Gauge &committed_gauge) :
+        executable_space_start(executable_space_start), entry(entry),
+        functions(std::move(functions)), image(std::move(image)), memory_limit(memory_limit),
+        deadline(deadline), instruction_budget(instruction_budget),
+        committed_gauge(committed_gauge) {}
 
     NaClContext(const NaClContext &other) = delete;
     NaClContext(const NaClContext &&other) = delete;
     NaClContext& operator=(const NaClContext &other) = delete;
 
 private:
+    template <typename Signature>
+    friend struct SandboxCall;
+
+    // Runs function with the given argument registers on a stack of its
+    // own and returns rax, or nothing if no stack is free or the call was
+    // aborted.
+    std::optional<uint64_t> enter(SandboxFunction function,
+                                  const std::array<uint64_t, 6> &registers);
+
+    // Takes a stack from the pool, carving a new one if none is free and
+    // the limits allow. Returns its index.
+    std::optional<unsigned int> acquire_stack();
+
+    void release_stack(unsigned int stack);
+
+    // Returns the end of the accessible region that contains offset, whose
+    // pages all allow protection, or 0 if there is none.
+    unsigned long accessible_end(unsigned long offset, int protection) const;
+
+    // Returns whether the size bytes at offset are all accessible with
+    // protection.
+    bool accessible(unsigned long offset, unsigned long size, int protection) const;
+
     char *executable_space_start;
-    char *f;
-};
\ No newline at end of file
+
+    // The function that call() calls, f.
+    SandboxFunction entry;
+
+    std::map<std::string, SandboxFunction> functions;
+
+    // The pristine sandbox, which the slot maps. Dropping the slot's pages
+    // brings the image back.
+    std::shared_ptr<SandboxImage> image;
+
+    // Commits or releases the heap's pages so that it ends at new_break.
+    // Returns false on failure. Must hold memory_lock.
+    bool move_break(unsigned long new_break);
+
+    size_t memory_limit;
+    std::chrono::milliseconds deadline;
+    uint64_t instruction_budget;
+
+    // Serializes changes to the heap and the stacks, and to what they
+    // commit.
+    std::mutex memory_lock;
+
+    // The heap is [image->end(), heap_break). Whole pages up to heap_break
+    // are committed. Read by host calls on other threads.
+    std::atomic<unsigned long> heap_break = 0;
+    bool heap_pinned = false;
+
+    // Stacks carved so far, and those no invocation is using.
+    std::atomic<unsigned int> stack_count = 0;
+    std::vector<unsigned int> free_stacks;
+
+    std::atomic<unsigned long> committed = 0;
+    Gauge &committed_gauge;
+
+    // Set when an invocation is aborted, until reset().
+    std::atomic<bool> poisoned = false;
+
+    // Scratch space for reset(), kept to avoid allocating on every call.
+    std::vector<std::pair<char*, size_t>> written_pages;
+};
+
+template <std::integral T>
+struct SandboxArgument<T> {
+    static constexpr size_t registers = 1;
+
+    static bool pack(const NaClContext &context, T value, uint64_t *out) {
+        out[0] = (uint64_t) value;
+        return true;
+    }
+};
+
+template <typename T>
+    requires std::is_enum_v<T>
+struct SandboxArgument<T> {
+    static constexpr size_t registers = 1;
+
+    static bool pack(const NaClContext &context, T value, uint64_t *out) {
+        out[0] = (uint64_t) value;
+        return true;
+    }
+};
+
+template <typename T>
+struct SandboxArgument<std::span<T>> {
+    static constexpr size_t registers = 2;
+
+    static bool pack(const NaClContext &context, std::span<T> value, uint64_t *out) {
+        if (value.empty()) {
+            out[0] = 0;
+            out[1] = 0;
+            return true;
+        }
+
+        std::optional<uint32_t> offset = context.offset_of(value.data());
+        out[0] = offset.value_or(0);
+        out[1] = value.size();
+        return offset.has_value() && context.span_at<T>(*offset, value.size()).has_value();
+    }
+};
+
+// Returns the T in a register written by sandboxed code. The SysV ABI only
+// defines the bits the type covers, such as al for a bool and eax for a
+// 32-bit integer, and sandboxed code may leave anything in the rest.
+template <typename T>
+T sandbox_register_value(uint64_t value) {
+    if constexpr (std::is_enum_v<T>) {
+        return (T) sandbox_register_value<std::underlying_type_t<T>>(value);
+    } else if constexpr (std::is_same_v<T, bool>) {
+        return (uint8_t) value != 0;
+    } else if constexpr (sizeof(T) == 1) {
+        return (T) (uint8_t) value;
+    } else if constexpr (sizeof(T) == 2) {
+        return (T) (uint16_t) value;
+    } else if constexpr (sizeof(T) == 4) {
+        return (T) (uint32_t) value;
+    } else {
+        return (T) value;
+    }
+}
+
+template <>
+struct SandboxResult<void> {
+    using Type = bool;
+
+    static Type failure() { return false; }
+
+    static Type unpack(const NaClContext &context, uint64_t value) { return true; }
+};
+
+template <std::integral T>
+struct SandboxResult<T> {
+    using Type = std::optional<T>;
+
+    static Type failure() { return {}; }
+
+    static Type unpack(const NaClContext &context, uint64_t value) {
+        return sandbox_register_value<T>(value);
+    }
+};
+
+template <typename T>
+    requires std::is_enum_v<T>
+struct SandboxResult<T> {
+    using Type = std::optional<T>;
+
+    static Type failure() { return {}; }
+
+    static Type unpack(const NaClContext &context, uint64_t value) {
+        return sandbox_register_value<T>(value);
+    }
+};
+
+template <>
+struct SandboxResult<std::string_view> {
+    using Type = std::optional<std::string_view>;
+
+    static Type failure() { return {}; }
+
+    static Type unpack(const NaClContext &context, uint64_t value) {
+        // Sandbox pointers are 32 bits; the rest of the register is junk.
+        uint32_t offset = value;
+        return offset == 0 ? std::nullopt : context.string_at(offset);
+    }
+};
+
+template <typename R, typename... Args>
+struct SandboxCall<R(Args...)> {
+    static_assert((SandboxArgument<Args>::registers + ... + 0) <= 6,
+                  "sandboxed functions take at most six registers of arguments");
+
+    static typename SandboxResult<R>::Type invoke(NaClContext &context, SandboxFunction function,
+                                                  Args... args) {
+        std::array<uint64_t, 6> registers = {};
+        [[maybe_unused]] size_t next = 0;
+        bool packed = (SandboxArgument<Args>::pack(
+            context, args, &registers[std::exchange(next, next + SandboxArgument<Args>::registers)])
+                       && ...);
+        if (!packed) {
+            return SandboxResult<R>::failure();
+        }
+        std::optional<uint64_t> result = context.enter(function, registers);
+        if (!result.has_value()) {
+            return SandboxResult<R>::failure();
+        }
+        return SandboxResult<R>::unpack(context, *result);
+    }
+};
+
+template <typename T>
+std::optional<std::span<T>> NaClContext::span_at(uint32_t offset, size_t count) const {
+    int protection = std::is_const_v<T> ? PROT_READ : PROT_READ | PROT_WRITE;
+    if (count > sandbox_slot_size / sizeof(T) || !accessible(offset, count * sizeof(T), protection)) {
+        return {};
+    }
+    return std::span<T>((T*) (executable_space_start + offset), count);
+}
@@ -0,0 +1,79 @@
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include "native_function.hh"
+
+extern "C" {
+#include <dlfcn.h>
+}
+
+using namespace std;
+
+namespace {
+
+// Response bodies larger than this need a second call.
+const size_t initial_response_capacity = 64 * 1024;
+
+thread_local vector<char> response_buffer(initial_response_capacity);
+
+}
+
+optional<NativeFunction> NativeFunction::resolve(void *dl_handle, const string &name) {
+    const uint32_t *abi_version = (const uint32_t*) dlsym(dl_handle, "m80_abi_version");
+    if (abi_version == nullptr) {
+        const char* (*legacy_main)(void) = (const char* (*)(void)) dlsym(dl_handle, "http_main");
+        if (legacy_main == nullptr) {
+            cerr << "Error: " << name << " has neither m80_main() nor http_main()." << endl;
+            return {};
+        }
+        return NativeFunction(dl_handle, 1, nullptr, legacy_main);
+    }
+
+    if (*abi_version != M80_ABI_VERSION) {
+        cerr << "Error: " << name << " uses ABI version " << *abi_version
+             << ", but only versions 1 and " << M80_ABI_VERSION << " are supported." << endl;
+        return {};
+    }
+
+    m80_main_fn main = (m80_main_fn) dlsym(dl_handle, "m80_main");
+    if (main == nullptr) {
+        cerr << "Error: function m80_main() is missing from " << name << "." << endl;
+        return {};
+    }
+    return NativeFunction(dl_handle, *abi_version, main, nullptr);
+}
+
+optional<string> NativeFunction::call(string_view request) const {
+    struct m80_request m80_request = {request.data(), request.length()};
+    struct m80_response response = {response_buffer.data(), response_buffer.size(), 0};
+
+    int result = invoke(&m80_request, &response);
+    if (result == M80_BUFFER_TOO_SMALL && response.length > response_buffer.size()) {
+        response_buffer.resize(response.length);
+        response = {response_buffer.data(), response_buffer.size(), 0};
+        result = invoke(&m80_request, &response);
+    }
+
+    if (result != M80_OK || response.length > response.capacity) {
+        return {};
+    }
+    return string(response.data, response.length);
+}
+
+int NativeFunction::invoke(const struct m80_request *request, struct m80_response *response) const {
+    return main != nullptr ? main(request, response) : call_legacy(response);
+}
+
+int NativeFunction::call_legacy(struct m80_response *response) const {
+    const char *body = legacy_main();
+    if (body == nullptr) {
+        return M80_ERROR;
+    }
+
+    response->length = strlen(body);
+    if (response->length > response->capacity) {
+        return M80_BUFFER_TOO_SMALL;
+    }
+    memcpy(response->data, body, response->length);
+    return M80_OK;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include "lib/m80.h"
+
+// A native function's entry point, resolved once when its library is loaded.
+class NativeFunction {
+public:
+    // Resolves the entry point of a dlopen()ed library. Returns nothing if the
+    // library has neither a supported m80_abi_version nor a legacy http_main.
+    static std::optional<NativeFunction> resolve(void *dl_handle, const std::string &name);
+
+    // Calls the function with request, writing into a per-thread buffer.
+    // Returns the response body, or nothing if the function failed.
+    std::optional<std::string> call(std::string_view request) const;
+
+    // Calls the function once with caller-owned buffers. Returns an M80_*
+    // code; legacy functions report M80_BUFFER_TOO_SMALL like v2 ones.
+    int invoke(const struct m80_request *request, struct m80_response *response) const;
+
+    void* get_dl_handle() const { return dl_handle; }
+
+    uint32_t get_abi_version() const { return abi_version; }
+
+private:
+    NativeFunction(void *dl_handle, uint32_t abi_version, m80_main_fn main,
+                   const char* (*legacy_main)(void))
+        : dl_handle(dl_handle), abi_version(abi_version), main(main),
+          legacy_main(legacy_main) {}
+
+    // Adapts a version 1 http_main() to the version 2 calling convention.
+    int call_legacy(struct m80_response *response) const;
+
+    void *dl_handle;
+    uint32_t abi_version;
+    m80_main_fn main;
+    const char* (*legacy_main)(void);
+};
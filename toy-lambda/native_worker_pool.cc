@@ -0,0 +1,157 @@
+#include <filesystem>
+#include <iostream>
+#include "native_worker_pool.hh"
+#include "stats.hh"
+
+extern "C" {
+#include <dlfcn.h>
+#include <stdlib.h>
+}
+
+using namespace std;
+
+namespace {
+
+Counter &private_copies = stats_counter("native_private_copies");
+
+// Copies path to a fresh temporary file. The dynamic loader keys libraries by
+// path and inode, so loading the copy always creates a new instance. Returns
+// the copy's path, or nothing on failure.
+optional<string> copy_to_temporary_file(const string &path) {
+    char temporary_path[] = "/tmp/m80-XXXXXX.so";
+    int fd = mkstemps(temporary_path, 3);
+    if (fd == -1) {
+        perror("mkstemps");
+        return {};
+    }
+    close(fd);
+
+    error_code error;
+    filesystem::copy_file(path, temporary_path, filesystem::copy_options::overwrite_existing, error);
+    if (error) {
+        cerr << "Unable to copy " << path << ": " << error.message() << endl;
+        unlink(temporary_path);
+        return {};
+    }
+    return temporary_path;
+}
+
+}
+
+NativeLibrary::~NativeLibrary() {
+    for (void *handle : dl_handles) {
+        dlclose(handle);
+    }
+}
+
+unique_ptr<NativeWorkerPool> NativeWorkerPool::create(unsigned int worker_count) {
+    unique_ptr<NativeWorkerPool> pool(new NativeWorkerPool());
+    for (unsigned int i = 0; i < worker_count; i++) {
+        pool->workers.push_back(make_unique<Worker>());
+    }
+    return pool;
+}
+
+NativeWorkerPool::~NativeWorkerPool() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+
+    for (auto &worker : workers) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+void NativeWorkerPool::start() {
+    for (unsigned int i = 0; i < workers.size(); i++) {
+        workers[i]->thread = thread(&NativeWorkerPool::run, this, i);
+    }
+}
+
+shared_ptr<NativeLibrary> NativeWorkerPool::load(const string &name, const string &path) {
+    lock_guard<mutex> guard(load_lock);
+
+    // Every namespace loads this one copy, so even a library overwritten in
+    // place gets fresh instances.
+    optional<string> snapshot = copy_to_temporary_file(path);
+    if (!snapshot.has_value()) {
+        return nullptr;
+    }
+
+    shared_ptr<NativeLibrary> library(new NativeLibrary());
+    for (auto &worker : workers) {
+        void *handle = nullptr;
+        if (worker->use_namespace) {
+            handle = dlmopen(worker->namespace_id, snapshot->c_str(), RTLD_NOW | RTLD_LOCAL);
+            if (handle != nullptr && worker->namespace_id == LM_ID_NEWLM) {
+                dlinfo(handle, RTLD_DI_LMID, &worker->namespace_id);
+            } else if (handle == nullptr && worker->namespace_id == LM_ID_NEWLM) {
+                // Out of namespaces. Copies are private to this worker as
+                // well, so use them from here on.
+                worker->use_namespace = false;
+            }
+        }
+
+        if (handle == nullptr && !worker->use_namespace) {
+            optional<string> copy = copy_to_temporary_file(path);
+            if (copy.has_value()) {
+                handle = dlopen(copy->c_str(), RTLD_NOW | RTLD_LOCAL);
+                unlink(copy->c_str());
+                private_copies.add();
+            }
+        }
+
+        if (handle == nullptr) {
+            const char *reason = dlerror();
+            cerr << "Unable to load " << path << ": " << (reason ? reason : "copy failed") << endl;
+            unlink(snapshot->c_str());
+            return nullptr;
+        }
+        library->dl_handles.push_back(handle);
+
+        optional<NativeFunction> function = NativeFunction::resolve(handle, name);
+        if (!function.has_value()) {
+            unlink(snapshot->c_str());
+            return nullptr;
+        }
+        library->functions.push_back(function.value());
+    }
+
+    // The mappings outlive the name.
+    unlink(snapshot->c_str());
+    return library;
+}
+
+void NativeWorkerPool::submit(TCPSocket client, shared_ptr<NativeLibrary> library, string request,
+                              RequestTimer timer) {
+    {
+        lock_guard<mutex> guard(lock);
+        jobs.push_back(Job{std::move(client), std::move(library), std::move(request), timer});
+    }
+    wakeup.notify_one();
+}
+
+void NativeWorkerPool::run(unsigned int worker) {
+    while (true) {
+        unique_lock<mutex> guard(lock);
+        wakeup.wait(guard, [this] { return stopping || !jobs.empty(); });
+        if (jobs.empty()) {
+            return;
+        }
+        Job job = std::move(jobs.front());
+        jobs.pop_front();
+        guard.unlock();
+
+        optional<string> response = job.library->function(worker).call(job.request);
+        if (!response.has_value()) {
+            job.client.write("HTTP/1.1 500 Internal Server Error\r\n");
+        } else {
+            job.client.write("HTTP/1.1 200 OK\r\n\r\n" + response.value());
+        }
+        job.timer.finish();
+    }
+}
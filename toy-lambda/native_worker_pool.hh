@@ -0,0 +1,99 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "native_function.hh"
+#include "stats.hh"
+#include "tcp_socket.hh"
+
+extern "C" {
+#include <link.h>
+}
+
+// One version of a native library, with a private instance per worker.
+// Unloaded once the last reference goes away.
+class NativeLibrary {
+public:
+    ~NativeLibrary();
+
+    NativeLibrary(const NativeLibrary &other) = delete;
+    NativeLibrary& operator=(const NativeLibrary &other) = delete;
+
+    const NativeFunction& function(unsigned int worker) const { return functions.at(worker); }
+
+private:
+    friend class NativeWorkerPool;
+
+    NativeLibrary() = default;
+
+    std::vector<NativeFunction> functions;
+    std::vector<void*> dl_handles;
+};
+
+// Runs native functions on a pool of worker threads. Every worker owns a
+// private instance of every library, so functions that keep state in globals
+// need no locking and calls on different workers never contend.
+//
+// A worker's instances live in its own dlmopen() namespace. glibc only has
+// a handful of namespaces, so workers past that load a private copy of each
+// library under a temporary path instead.
+class NativeWorkerPool {
+public:
+    static std::unique_ptr<NativeWorkerPool> create(unsigned int worker_count);
+
+    ~NativeWorkerPool();
+
+    NativeWorkerPool(const NativeWorkerPool &other) = delete;
+    NativeWorkerPool& operator=(const NativeWorkerPool &other) = delete;
+
+    // Starts the worker threads.
+    void start();
+
+    unsigned int worker_count() const { return workers.size(); }
+
+    // Loads a new version of the library at path for every worker. Versions
+    // never share state, even if path was overwritten in place. May be called
+    // from any thread. Returns nullptr if the library fails to load or
+    // resolve.
+    std::shared_ptr<NativeLibrary> load(const std::string &name, const std::string &path);
+
+    // Queues a call to library, whose response is written to client by
+    // whichever worker picks it up. timer finishes once it is written.
+    void submit(TCPSocket client, std::shared_ptr<NativeLibrary> library, std::string request,
+                RequestTimer timer = {});
+
+private:
+    struct Job {
+        TCPSocket client;
+        std::shared_ptr<NativeLibrary> library;
+        std::string request;
+        RequestTimer timer;
+    };
+
+    struct Worker {
+        // The worker's namespace, until it is created or found unavailable.
+        Lmid_t namespace_id = LM_ID_NEWLM;
+        bool use_namespace = true;
+
+        std::thread thread;
+    };
+
+    NativeWorkerPool() = default;
+
+    void run(unsigned int worker);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    // Serializes load(), which updates the workers' namespaces.
+    std::mutex load_lock;
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::deque<Job> jobs;
+    bool stopping = false;
+};
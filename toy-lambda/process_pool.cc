@@ -0,0 +1,493 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include "native_function.hh"
+#include "process_pool.hh"
+#include "stats.hh"
+
+extern "C" {
+#include <dlfcn.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+using namespace std;
+
+namespace {
+
+// How often a driver waiting on a response checks that its worker is alive.
+const chrono::milliseconds liveness_interval(100);
+
+// How often the zygote reaps the workers that have exited, when it is not
+// asked to fork any.
+const chrono::milliseconds reap_interval(1000);
+
+// The server's end of the zygote's socket. A request is the function's name
+// and the library's path, each NUL-terminated, with the channel's memfd
+// attached. The reply is the worker's pid, or -1 on failure, with a pidfd
+// for it attached. Requests and their replies are paired under zygote_lock.
+int zygote_socket = -1;
+mutex zygote_lock;
+
+const size_t max_zygote_request = 8192;
+
+// Sends size bytes of data as one message, with fd attached unless it is
+// negative. Returns false on failure.
+bool send_message(int socket, const void *data, size_t size, int fd) {
+    struct iovec buffer = {.iov_base = const_cast<void*>(data), .iov_len = size};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr message = {};
+    message.msg_iov = &buffer;
+    message.msg_iovlen = 1;
+    if (fd >= 0) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+    return sendmsg(socket, &message, MSG_NOSIGNAL) == (ssize_t) size;
+}
+
+// Receives one message of up to size bytes into data, and the descriptor
+// attached to it, if any, into fd. Returns the message's size, 0 once the
+// other end is closed, or -1 on failure.
+ssize_t receive_message(int socket, void *data, size_t size, int &fd) {
+    struct iovec buffer = {.iov_base = data, .iov_len = size};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr message = {};
+    message.msg_iov = &buffer;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    fd = -1;
+    ssize_t received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); received >= 0 && header != nullptr;
+         header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(header), sizeof(int));
+        }
+    }
+    return received;
+}
+
+#define ALLOW_SYSCALL(name)                                             \
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_##name, 0, 1),             \
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+
+// Allows what a worker needs to wait on its rings and to allocate memory.
+// Anything else, including opening files and sockets, kills the process.
+bool install_seccomp_filter() {
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        ALLOW_SYSCALL(futex),
+        ALLOW_SYSCALL(brk),
+        ALLOW_SYSCALL(mmap),
+        ALLOW_SYSCALL(munmap),
+        ALLOW_SYSCALL(mremap),
+        ALLOW_SYSCALL(mprotect),
+        ALLOW_SYSCALL(madvise),
+        ALLOW_SYSCALL(clock_gettime),
+        ALLOW_SYSCALL(rt_sigreturn),
+        ALLOW_SYSCALL(exit),
+        ALLOW_SYSCALL(exit_group),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+    };
+    struct sock_fprog program = {
+        .len = static_cast<unsigned short>(sizeof(filter) / sizeof(filter[0])),
+        .filter = filter,
+    };
+
+    return prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0 &&
+        prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) == 0;
+}
+
+#undef ALLOW_SYSCALL
+
+}
+
+bool ProcessPool::start_zygote() {
+    // A thread started earlier could hold a lock the zygote would inherit
+    // held, and every worker after it.
+    error_code error;
+    auto threads = filesystem::directory_iterator("/proc/self/task", error);
+    if (error || distance(threads, filesystem::directory_iterator()) != 1) {
+        cerr << "The process pool zygote must be started before any thread." << endl;
+        return false;
+    }
+
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0) {
+        perror("socketpair");
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(sockets[0]);
+        close(sockets[1]);
+        return false;
+    } else if (pid == 0) {
+        close(sockets[0]);
+        run_zygote(sockets[1]);
+    }
+
+    close(sockets[1]);
+    zygote_socket = sockets[0];
+    return true;
+}
+
+unique_ptr<ProcessPool> ProcessPool::create(const string &name, const string &path,
+                                            unsigned int process_count,
+                                            chrono::milliseconds deadline) {
+    unique_ptr<ProcessPool> pool(new ProcessPool(name, path, deadline));
+    for (unsigned int i = 0; i < process_count; i++) {
+        pool->workers.push_back(make_unique<Worker>());
+        Worker &worker = *pool->workers.back();
+        worker.channel_fd = memfd_create(("process-pool-" + name).c_str(), MFD_CLOEXEC);
+        if (worker.channel_fd == -1 || ftruncate(worker.channel_fd, sizeof(Channel)) != 0) {
+            perror("memfd_create");
+            return nullptr;
+        }
+        void *channel = mmap(nullptr, sizeof(Channel), PROT_READ | PROT_WRITE, MAP_SHARED,
+                             worker.channel_fd, 0);
+        if (channel == MAP_FAILED) {
+            perror("mmap");
+            return nullptr;
+        }
+        worker.channel = static_cast<Channel*>(channel);
+        if (!pool->spawn(worker)) {
+            return nullptr;
+        }
+    }
+
+    return pool;
+}
+
+void ProcessPool::start() {
+    drivers = workers.size();
+    for (auto &worker : workers) {
+        worker->driver = thread(&ProcessPool::drive, this, ref(*worker));
+    }
+}
+
+ProcessPool::~ProcessPool() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+
+    for (auto &worker : workers) {
+        if (worker->driver.joinable()) {
+            worker->driver.join();
+        }
+        kill_process(*worker);
+        if (worker->channel != nullptr) {
+            munmap(worker->channel, sizeof(Channel));
+        }
+        if (worker->channel_fd != -1) {
+            close(worker->channel_fd);
+        }
+    }
+}
+
+void ProcessPool::submit(TCPSocket client, string request, RequestTimer timer) {
+    {
+        lock_guard<mutex> guard(lock);
+        if (!broken) {
+            jobs.push_back(Job{std::move(client), std::move(request), timer});
+            wakeup.notify_one();
+            return;
+        }
+    }
+    client.write("HTTP/1.1 503 Service Unavailable\r\n");
+    timer.finish();
+}
+
+bool ProcessPool::failed() {
+    lock_guard<mutex> guard(lock);
+    return broken;
+}
+
+void ProcessPool::abandon() {
+    deque<Job> failed_jobs;
+    {
+        lock_guard<mutex> guard(lock);
+        if (--drivers > 0) {
+            return;
+        }
+        broken = true;
+        failed_jobs = std::move(jobs);
+        jobs.clear();
+    }
+
+    cerr << "No worker process left for " << name << "; failing its requests." << endl;
+    for (Job &job : failed_jobs) {
+        job.client.write("HTTP/1.1 503 Service Unavailable\r\n");
+        job.timer.finish();
+    }
+}
+
+bool ProcessPool::spawn(Worker &worker) {
+    worker.channel->requests.reset();
+    worker.channel->responses.reset();
+
+    string request = name + '\0' + path + '\0';
+    if (request.length() > max_zygote_request) {
+        cerr << "Unable to fork a worker process for " << name << ": path too long." << endl;
+        return false;
+    }
+
+    pid_t pid = -1;
+    int process = -1;
+    {
+        lock_guard<mutex> guard(zygote_lock);
+        if (zygote_socket == -1) {
+            cerr << "Unable to fork a worker process for " << name << ": no zygote." << endl;
+            return false;
+        }
+        if (!send_message(zygote_socket, request.data(), request.length(), worker.channel_fd) ||
+            receive_message(zygote_socket, &pid, sizeof(pid), process) != sizeof(pid)) {
+            perror("zygote");
+            return false;
+        }
+    }
+    if (pid == -1 || process == -1) {
+        cerr << "Unable to fork a worker process for " << name << "." << endl;
+        if (process != -1) {
+            close(process);
+        }
+        return false;
+    }
+
+    worker.process = process;
+    return true;
+}
+
+void ProcessPool::kill_process(Worker &worker) {
+    if (worker.process != -1) {
+        syscall(SYS_pidfd_send_signal, worker.process, SIGKILL, nullptr, 0);
+        struct pollfd exit = {.fd = worker.process, .events = POLLIN};
+        poll(&exit, 1, -1);
+        close(worker.process);
+        worker.process = -1;
+    }
+}
+
+bool ProcessPool::exited(const Worker &worker) {
+    struct pollfd exit = {.fd = worker.process, .events = POLLIN};
+    return poll(&exit, 1, 0) > 0;
+}
+
+void ProcessPool::drive(Worker &worker) {
+    Counter &restarts = stats_counter("process_worker_restarts{function=\"" + name + "\"}");
+
+    // Requests in the ring, oldest first. Responses come back in the same
+    // order.
+    deque<Job> in_flight;
+    vector<Job> batch;
+
+    while (true) {
+        {
+            unique_lock<mutex> guard(lock);
+            if (in_flight.empty()) {
+                wakeup.wait(guard, [this] { return stopping || !jobs.empty(); });
+            }
+            // A pool is stopped once unpublished, so finish what was queued.
+            if (stopping && jobs.empty() && in_flight.empty()) {
+                return;
+            }
+            while (!jobs.empty() && in_flight.size() + batch.size() < ShmRing::slot_count) {
+                batch.push_back(std::move(jobs.front()));
+                jobs.pop_front();
+            }
+        }
+
+        for (Job &job : batch) {
+            if (job.request.length() > ShmRing::slot_capacity) {
+                job.client.write("HTTP/1.1 413 Content Too Large\r\n");
+                job.timer.finish();
+                continue;
+            }
+
+            // Never waits: at most slot_count requests are in flight.
+            ShmRing::Slot *slot = worker.channel->requests.begin_push(chrono::milliseconds(-1));
+            slot->length = job.request.length();
+            memcpy(slot->data, job.request.data(), job.request.length());
+            worker.channel->requests.end_push();
+            job.deadline = chrono::steady_clock::now() + deadline;
+            in_flight.push_back(std::move(job));
+        }
+        batch.clear();
+
+        if (in_flight.empty()) {
+            continue;
+        }
+
+        // The worker answers in order, so only the oldest request can be
+        // overdue.
+        chrono::milliseconds wait = liveness_interval;
+        if (deadline.count() > 0) {
+            auto remaining = chrono::ceil<chrono::milliseconds>(
+                in_flight.front().deadline - chrono::steady_clock::now());
+            wait = clamp(remaining, chrono::milliseconds(0), liveness_interval);
+        }
+
+        ShmRing::Slot *slot = worker.channel->responses.begin_pop(wait);
+        if (slot == nullptr) {
+            bool hung = deadline.count() > 0 &&
+                        chrono::steady_clock::now() >= in_flight.front().deadline;
+            if (!hung && !exited(worker)) {
+                continue;
+            }
+
+            if (hung) {
+                cerr << "Worker process for " << name << " missed its deadline; restarting it."
+                     << endl;
+                in_flight.front().client.write("HTTP/1.1 503 Service Unavailable\r\n");
+                in_flight.front().timer.finish();
+                in_flight.pop_front();
+            } else {
+                cerr << "Worker process for " << name << " died; restarting it." << endl;
+            }
+            kill_process(worker);
+            for (Job &job : in_flight) {
+                job.client.write("HTTP/1.1 500 Internal Server Error\r\n");
+                job.timer.finish();
+            }
+            in_flight.clear();
+            restarts.add();
+            if (!spawn(worker)) {
+                abandon();
+                return;
+            }
+            continue;
+        }
+
+        do {
+            Job &job = in_flight.front();
+            if (slot->status == M80_OK) {
+                job.client.write("HTTP/1.1 200 OK\r\n\r\n" + string(slot->data, slot->length));
+            } else {
+                job.client.write("HTTP/1.1 500 Internal Server Error\r\n");
+            }
+            job.timer.finish();
+            in_flight.pop_front();
+            worker.channel->responses.end_pop();
+        } while (!worker.channel->responses.empty() &&
+                 (slot = worker.channel->responses.begin_pop(chrono::milliseconds(0))) != nullptr);
+    }
+}
+
+void ProcessPool::run_zygote(int socket) {
+    // Die with the server.
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    char request[max_zygote_request + 1];
+    while (true) {
+        struct pollfd ready = {.fd = socket, .events = POLLIN};
+        int polled = poll(&ready, 1, reap_interval.count());
+        while (waitpid(-1, nullptr, WNOHANG) > 0) {
+        }
+        if (polled <= 0) {
+            continue;
+        }
+
+        int channel_fd;
+        ssize_t size = receive_message(socket, request, max_zygote_request, channel_fd);
+        if (size <= 0) {
+            _exit(0);
+        }
+        request[size] = '\0';
+        const char *name = request;
+        const char *path = name + strlen(name) + 1;
+
+        pid_t pid = -1;
+        if (channel_fd != -1 && path < request + size) {
+            pid = fork();
+            if (pid == 0) {
+                close(socket);
+                serve(name, path, channel_fd);
+            }
+        }
+        if (channel_fd != -1) {
+            close(channel_fd);
+        }
+
+        int process = pid > 0 ? syscall(SYS_pidfd_open, pid, 0) : -1;
+        if (pid > 0 && process == -1) {
+            kill(pid, SIGKILL);
+            pid = -1;
+        }
+        send_message(socket, &pid, sizeof(pid), process);
+        if (process != -1) {
+            close(process);
+        }
+    }
+}
+
+void ProcessPool::serve(const string &name, const string &path, int channel_fd) {
+    // Die with the zygote, which dies with the server.
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    void *mapping = mmap(nullptr, sizeof(Channel), PROT_READ | PROT_WRITE, MAP_SHARED,
+                         channel_fd, 0);
+    if (mapping == MAP_FAILED) {
+        _exit(1);
+    }
+    Channel *channel = static_cast<Channel*>(mapping);
+
+    // Keep nothing else the zygote had open.
+    syscall(SYS_close_range, 3, ~0U, 0);
+
+    void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        cerr << "Unable to load " << path << ": " << dlerror() << endl;
+        _exit(1);
+    }
+    optional<NativeFunction> function = NativeFunction::resolve(handle, name);
+    if (!function.has_value()) {
+        _exit(1);
+    }
+
+    if (!install_seccomp_filter()) {
+        perror("seccomp");
+        _exit(1);
+    }
+
+    while (true) {
+        ShmRing::Slot *request_slot = channel->requests.begin_pop(chrono::milliseconds(-1));
+        ShmRing::Slot *response_slot = channel->responses.begin_push(chrono::milliseconds(-1));
+
+        struct m80_request request = {request_slot->data, request_slot->length};
+        struct m80_response response = {response_slot->data, ShmRing::slot_capacity, 0};
+        int status = function->invoke(&request, &response);
+        if (status == M80_OK && response.length > response.capacity) {
+            status = M80_ERROR;
+        }
+        response_slot->status = status;
+        response_slot->length = status == M80_OK ? response.length : 0;
+
+        channel->requests.end_pop();
+        channel->responses.end_push();
+    }
+}
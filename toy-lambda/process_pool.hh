@@ -0,0 +1,138 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "shm_ring.hh"
+#include "stats.hh"
+#include "tcp_socket.hh"
+
+extern "C" {
+#include <sys/types.h>
+}
+
+// Runs one native function in pre-forked worker processes. Each process
+// dlopen()s the library, locks itself down with a seccomp filter and then
+// serves requests from a shared-memory ring. This costs a copy per request
+// and no system calls while the rings stay busy, unlike V8's isolation.
+//
+// Workers are not forked by the server, whose other threads may hold locks
+// at any moment that the child would then never see released, and whose
+// sockets the child would inherit. A zygote process, forked before the
+// server starts any threads, forks every worker on request instead, so pools
+// can be created and workers replaced from any thread. A worker keeps no
+// file descriptor but its channel.
+//
+// A worker process that dies, or leaves a request unanswered past its
+// deadline, fails its outstanding requests and is replaced. A pool whose
+// workers can no longer be replaced fails every request.
+class ProcessPool {
+public:
+    // Forks the zygote. Must be called before the server starts any thread,
+    // and fails otherwise. Returns false on failure.
+    static bool start_zygote();
+
+    // Has the zygote fork process_count workers for the library at path.
+    // A worker is considered hung once it leaves a request unanswered for
+    // deadline, unless deadline is zero. Safe from any thread, such as the
+    // reloader's. Returns nullptr if shared memory cannot be mapped or a
+    // worker cannot be forked.
+    static std::unique_ptr<ProcessPool> create(const std::string &name, const std::string &path,
+                                               unsigned int process_count,
+                                               std::chrono::milliseconds deadline);
+
+    // Starts serving submitted requests.
+    void start();
+
+    // Serves the requests already submitted, then kills the workers.
+    ~ProcessPool();
+
+    ProcessPool(const ProcessPool &other) = delete;
+    ProcessPool& operator=(const ProcessPool &other) = delete;
+
+    // Queues a request, whose response is written to client once a worker
+    // process has served it. timer finishes once it is written.
+    void submit(TCPSocket client, std::string request, RequestTimer timer = {});
+
+    // Whether every worker was lost and could not be replaced. A failed
+    // pool answers every request with 503 and should be replaced.
+    bool failed();
+
+private:
+    // Shared between a driver thread and its worker process.
+    struct Channel {
+        ShmRing requests;
+        ShmRing responses;
+    };
+
+    struct Job {
+        TCPSocket client;
+        std::string request;
+        RequestTimer timer;
+
+        // When the worker must have answered. Set once in flight.
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    struct Worker {
+        // The worker process, which is the zygote's child rather than the
+        // server's, as a pidfd.
+        int process = -1;
+
+        // The channel and the memfd it is mapped from, which every process
+        // forked for the worker maps.
+        Channel *channel = nullptr;
+        int channel_fd = -1;
+
+        // Feeds the worker process and writes its responses.
+        std::thread driver;
+    };
+
+    ProcessPool(const std::string &name, const std::string &path,
+                std::chrono::milliseconds deadline)
+        : name(name), path(path), deadline(deadline) {}
+
+    // Has the zygote fork a fresh worker process on worker's channel.
+    // Returns false on failure.
+    bool spawn(Worker &worker);
+
+    // Kills worker's process, if it is running, and waits for it to exit.
+    static void kill_process(Worker &worker);
+
+    // Whether worker's process has exited.
+    static bool exited(const Worker &worker);
+
+    void drive(Worker &worker);
+
+    // Called by a driver whose worker cannot be replaced. Once no driver is
+    // left, marks the pool failed and fails the queued requests.
+    void abandon();
+
+    // The zygote's main loop, serving fork requests from socket until the
+    // server closes it.
+    [[noreturn]] static void run_zygote(int socket);
+
+    // The worker process's main loop, on the channel mapped from
+    // channel_fd. Never returns.
+    [[noreturn]] static void serve(const std::string &name, const std::string &path,
+                                   int channel_fd);
+
+    const std::string name;
+    const std::string path;
+    const std::chrono::milliseconds deadline;
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::deque<Job> jobs;
+    bool stopping = false;
+
+    // Drivers still serving, and whether none is.
+    size_t drivers = 0;
+    bool broken = false;
+};
@@ -0,0 +1,30 @@
+#include <thread>
+#include "rcu.hh"
+
+using namespace std;
+
+namespace {
+
+// How long a waiting writer sleeps between checks on the readers.
+const chrono::microseconds grace_period_poll_interval(100);
+
+}
+
+QSBRDomain::Reader& QSBRDomain::register_reader() {
+    lock_guard<mutex> guard(readers_lock);
+    readers.push_back(unique_ptr<Reader>(new Reader(this)));
+    return *readers.back();
+}
+
+void QSBRDomain::synchronize() {
+    // A reader that saw the new epoch has passed a quiescent state after
+    // everything the caller did before this increment.
+    uint64_t target = epoch.fetch_add(1, memory_order_seq_cst) + 1;
+
+    lock_guard<mutex> guard(readers_lock);
+    for (auto &reader : readers) {
+        while (reader->seen.load(memory_order_acquire) < target) {
+            this_thread::sleep_for(grace_period_poll_interval);
+        }
+    }
+}
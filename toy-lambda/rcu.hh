@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Quiescent-state-based RCU. Readers dereference protected pointers without
+// any synchronization, and report a quiescent state whenever they hold no
+// such pointers, e.g. once per event loop turn. A writer that unpublished a
+// pointer waits out a grace period, in which every reader reports at least
+// once, before freeing what it pointed to.
+class QSBRDomain {
+public:
+    class Reader {
+    public:
+        // Declares that the calling reader holds no protected pointers.
+        void quiescent() { seen.store(domain->epoch.load(std::memory_order_seq_cst),
+                                      std::memory_order_release); }
+
+    private:
+        friend class QSBRDomain;
+
+        explicit Reader(QSBRDomain *domain) : domain(domain), seen(domain->epoch.load()) {}
+
+        QSBRDomain *domain;
+        std::atomic<uint64_t> seen;
+    };
+
+    QSBRDomain() = default;
+
+    QSBRDomain(const QSBRDomain &other) = delete;
+    QSBRDomain& operator=(const QSBRDomain &other) = delete;
+
+    // Registers a reader thread. The reference is valid for the lifetime of
+    // the domain. A reader that stops reporting stalls every writer.
+    Reader& register_reader();
+
+    // Waits until every reader has reported a quiescent state since the call.
+    // Pointers unpublished before the call can be freed afterwards.
+    void synchronize();
+
+private:
+    std::atomic<uint64_t> epoch = 1;
+
+    std::mutex readers_lock;
+    std::vector<std::unique_ptr<Reader>> readers;
+};
@@ -0,0 +1,102 @@
+#include <array>
+#include <cstring>
+#include <iostream>
+#include "reloader.hh"
+#include "stats.hh"
+
+extern "C" {
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+}
+
+using namespace std;
+
+namespace {
+
+Counter &reloads = stats_counter("reloads");
+
+// Set in the event counter by the destructor, on top of any requests.
+const uint64_t stop_event = 1ULL << 32;
+
+}
+
+unique_ptr<Reloader> Reloader::create(const vector<string> &directories, function<void()> reload) {
+    int inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotify_fd == -1) {
+        perror("inotify_init1");
+        return nullptr;
+    }
+
+    for (const string &directory : directories) {
+        const uint32_t events = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+        if (inotify_add_watch(inotify_fd, directory.c_str(), events) == -1) {
+            cerr << "Unable to watch " << directory << ": " << strerror(errno) << endl;
+            close(inotify_fd);
+            return nullptr;
+        }
+    }
+
+    int event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd == -1) {
+        perror("eventfd");
+        close(inotify_fd);
+        return nullptr;
+    }
+
+    unique_ptr<Reloader> reloader(new Reloader(inotify_fd, event_fd, std::move(reload)));
+    reloader->thread = std::thread(&Reloader::run, reloader.get());
+    return reloader;
+}
+
+Reloader::~Reloader() {
+    uint64_t value = stop_event;
+    if (write(event_fd, &value, sizeof(value)) == sizeof(value) && thread.joinable()) {
+        thread.join();
+    }
+    close(inotify_fd);
+    close(event_fd);
+}
+
+void Reloader::request() {
+    uint64_t value = 1;
+    if (write(event_fd, &value, sizeof(value)) != sizeof(value)) {
+        perror("write");
+    }
+}
+
+void Reloader::run() {
+    while (true) {
+        struct pollfd fds[] = {{inotify_fd, POLLIN, 0}, {event_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+            perror("poll");
+            return;
+        }
+        if (!drain()) {
+            return;
+        }
+
+        // Let the burst of changes settle.
+        while (poll(fds, 2, reload_settle_time.count()) > 0) {
+            if (!drain()) {
+                return;
+            }
+        }
+
+        reload();
+        reloads.add();
+    }
+}
+
+bool Reloader::drain() {
+    array<char, 4096> buffer;
+    while (read(inotify_fd, buffer.data(), buffer.size()) > 0) {}
+
+    uint64_t value = 0;
+    if (read(event_fd, &value, sizeof(value)) == sizeof(value) && value >= stop_event) {
+        stopping = true;
+    }
+    return !stopping;
+}
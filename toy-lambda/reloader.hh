@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Files are considered settled once no change was seen for this long, so a
+// build that writes a library in several steps triggers one reload.
+const std::chrono::milliseconds reload_settle_time(100);
+
+// Calls a reload function on its own thread whenever files in the watched
+// directories change, and whenever asked to.
+class Reloader {
+public:
+    // Returns nullptr if the directories cannot be watched.
+    static std::unique_ptr<Reloader> create(const std::vector<std::string> &directories,
+                                            std::function<void()> reload);
+
+    ~Reloader();
+
+    Reloader(const Reloader &other) = delete;
+    Reloader& operator=(const Reloader &other) = delete;
+
+    // Schedules a reload without waiting for it.
+    void request();
+
+private:
+    Reloader(int inotify_fd, int event_fd, std::function<void()> reload)
+        : inotify_fd(inotify_fd), event_fd(event_fd), reload(std::move(reload)) {}
+
+    void run();
+
+    // Reads and discards pending events. Returns false if the reloader
+    // should stop.
+    bool drain();
+
+    int inotify_fd;
+
+    // Signalled by request() and the destructor.
+    int event_fd;
+
+    std::function<void()> reload;
+    bool stopping = false;
+    std::thread thread;
+};
@@ -0,0 +1,4 @@
+async function main() {
+    await sleep(10);
+    return 'hello world';
+}
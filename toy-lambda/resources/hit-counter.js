@@ -0,0 +1,5 @@
+function main(host) {
+    host.kvSet('hits', host.kvGet('hits') + 1);
+    host.write('hits: ');
+    return host.kvGet('hits').toString();
+}
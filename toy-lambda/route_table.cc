@@ -0,0 +1,80 @@
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "route_table.hh"
+
+using namespace std;
+
+namespace {
+
+optional<FunctionRoute::Runtime> parse_runtime(const string &name) {
+    if (name == "js") {
+        return FunctionRoute::js;
+    } else if (name == "wasm") {
+        return FunctionRoute::wasm;
+    } else if (name == "native") {
+        return FunctionRoute::native;
+    } else if (name == "nacl") {
+        return FunctionRoute::nacl;
+    }
+    return {};
+}
+
+}
+
+optional<map<string, FunctionRoute>> load_manifest(const string &path) {
+    map<string, FunctionRoute> routes;
+    ifstream file(path);
+    if (!file) {
+        cerr << "Unable to read " << path << endl;
+        return {};
+    }
+
+    string line;
+    for (int line_number = 1; getline(file, line); line_number++) {
+        istringstream fields(line);
+        string page, runtime_name, function_path;
+        if (!(fields >> page) || page.starts_with("#")) {
+            continue;
+        }
+
+        optional<FunctionRoute::Runtime> runtime;
+        if (!(fields >> runtime_name >> function_path) ||
+            !(runtime = parse_runtime(runtime_name)).has_value()) {
+            cerr << path << ":" << line_number << ": expected <page> <js|wasm|native|nacl> <path>" << endl;
+            return {};
+        }
+
+        // A missing file is only an error once the page is requested.
+        error_code error;
+        filesystem::file_time_type version = filesystem::last_write_time(function_path, error);
+        routes[page] = {runtime.value(), function_path, version};
+    }
+    return routes;
+}
+
+map<string, FunctionRoute> scan_function_directories() {
+    map<string, FunctionRoute> routes;
+    for (const auto &entry : filesystem::directory_iterator("resources/")) {
+        if (entry.is_regular_file()) {
+            FunctionRoute::Runtime runtime =
+                entry.path().extension() == ".wasm" ? FunctionRoute::wasm : FunctionRoute::js;
+            routes[entry.path().filename()] = {runtime, entry.path(), entry.last_write_time()};
+        }
+    }
+
+    for (const auto &entry : filesystem::directory_iterator("build/lib/")) {
+        if (entry.path().extension() == ".so") {
+            routes[entry.path().filename()] =
+                {FunctionRoute::native, entry.path(), entry.last_write_time()};
+        }
+    }
+
+    for (const auto &entry : filesystem::directory_iterator("native_client_bin/")) {
+        if (entry.is_regular_file()) {
+            routes[entry.path().filename()] =
+                {FunctionRoute::nacl, entry.path(), entry.last_write_time()};
+        }
+    }
+    return routes;
+}
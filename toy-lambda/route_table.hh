@@ -0,0 +1,49 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include "function_limits.hh"
+
+// Pages under this prefix run native functions in the process tier, e.g.
+// /proc/fib.so.
+const std::string process_route_prefix = "proc/";
+
+// Where a function comes from. Routes are cheap: nothing is read or loaded
+// until the function's first request.
+struct FunctionRoute {
+    enum Runtime {
+        js,
+        wasm,
+        native,
+        nacl,
+    };
+
+    Runtime runtime;
+    std::string path;
+
+    // When the file was last modified. A loaded function whose version
+    // differs is stale.
+    std::filesystem::file_time_type version;
+};
+
+// Everything requests are routed to. A table is built off the hot path and
+// published whole; it never changes afterwards.
+struct RouteTable {
+    FunctionLimitsTable limits;
+
+    // Functions, by page.
+    std::map<std::string, FunctionRoute> functions;
+};
+
+// Reads routes from a manifest of lines like
+//   <page> <runtime> <path>
+// where runtime is js, wasm, native or nacl. Blank lines and lines starting with
+// '#' are ignored. Returns nothing if the manifest cannot be parsed.
+std::optional<std::map<std::string, FunctionRoute>> load_manifest(const std::string &path);
+
+// Routes every file in resources/ (JS, or Wasm for .wasm files), every .so
+// in build/lib/ and every executable in native_client_bin/ under its file
+// name.
+std::map<std::string, FunctionRoute> scan_function_directories();
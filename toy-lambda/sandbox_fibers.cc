@@ -0,0 +1,167 @@
+#include <cstdio>
+#include <thread>
+#include "nacl_loader.hh"
+#include "sandbox_fibers.hh"
+#include "sandbox_switch.hh"
+
+extern "C" {
+#include <sys/mman.h>
+}
+
+using namespace std;
+
+namespace {
+
+const size_t guard_size = 4096;
+
+// The fiber running on this thread.
+thread_local FiberScheduler::Fiber *running = nullptr;
+
+}
+
+class FiberScheduler::Fiber {
+public:
+    explicit Fiber(FiberScheduler &scheduler) : scheduler(scheduler) {}
+
+    ~Fiber() {
+        if (stack != MAP_FAILED) {
+            munmap(stack, guard_size + stack_size);
+        }
+    }
+
+    FiberScheduler &scheduler;
+    function<void()> task;
+
+    // A guard page, then the stack.
+    void *stack = MAP_FAILED;
+    void *rsp = nullptr;
+
+    // Guarded by the scheduler's lock.
+    bool parked = false;
+    bool woken = false;
+};
+
+FiberScheduler::FiberScheduler() = default;
+
+FiberScheduler::~FiberScheduler() = default;
+
+void FiberScheduler::spawn(function<void()> task) {
+    Fiber *fiber;
+    if (!finished.empty()) {
+        fiber = finished.back();
+        finished.pop_back();
+    } else {
+        fibers.push_back(make_unique<Fiber>(*this));
+        fiber = fibers.back().get();
+        fiber->stack = mmap(nullptr, guard_size + stack_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (fiber->stack == MAP_FAILED || mprotect(fiber->stack, guard_size, PROT_NONE) != 0) {
+            perror("allocating a fiber stack");
+            fibers.pop_back();
+            return;
+        }
+    }
+    fiber->task = std::move(task);
+
+    // The frame sandbox_switch.hh describes, for the first switch.
+    uint64_t *top = (uint64_t*) ((char*) fiber->stack + guard_size + stack_size);
+    top[-1] = (uint64_t) &sandbox_fiber_start;
+    top[-2] = 0;
+    top[-3] = 0;
+    top[-4] = (uint64_t) fiber;
+    top[-5] = (uint64_t) &FiberScheduler::start;
+    top[-6] = 0;
+    top[-7] = 0;
+    top[-8] = 0;
+    top[-9] = 0x1f80 | (0x37fUL << 32);
+    fiber->rsp = &top[-9];
+
+    lock_guard<mutex> guard(lock);
+    ready.push_back(fiber);
+}
+
+void FiberScheduler::run() {
+    while (true) {
+        Fiber *fiber;
+        {
+            lock_guard<mutex> guard(lock);
+            auto now = chrono::steady_clock::now();
+            while (!timers.empty() && timers.begin()->first <= now) {
+                wake_locked(timers.begin()->second);
+                timers.erase(timers.begin());
+            }
+            if (ready.empty()) {
+                return;
+            }
+            fiber = ready.front();
+            ready.pop_front();
+        }
+
+        running = fiber;
+        sandbox_fiber_switch(&scheduler_rsp, fiber->rsp);
+        running = nullptr;
+        if (!fiber->task) {
+            finished.push_back(fiber);
+        }
+    }
+}
+
+FiberScheduler::Fiber* FiberScheduler::current() {
+    return running;
+}
+
+void FiberScheduler::park() {
+    Fiber *fiber = running;
+    {
+        lock_guard<mutex> guard(fiber->scheduler.lock);
+        if (fiber->woken) {
+            fiber->woken = false;
+            return;
+        }
+        fiber->parked = true;
+    }
+    fiber->scheduler.suspend(*fiber);
+}
+
+void FiberScheduler::wake(Fiber *fiber) {
+    lock_guard<mutex> guard(fiber->scheduler.lock);
+    fiber->scheduler.wake_locked(fiber);
+}
+
+void FiberScheduler::wake_locked(Fiber *fiber) {
+    if (fiber->parked) {
+        fiber->parked = false;
+        ready.push_back(fiber);
+    } else {
+        fiber->woken = true;
+    }
+}
+
+void FiberScheduler::sleep_for(chrono::milliseconds duration) {
+    Fiber *fiber = running;
+    if (fiber == nullptr) {
+        this_thread::sleep_for(duration);
+        return;
+    }
+    {
+        lock_guard<mutex> guard(fiber->scheduler.lock);
+        fiber->scheduler.timers.emplace(chrono::steady_clock::now() + duration, fiber);
+    }
+    park();
+}
+
+void FiberScheduler::start(void *argument) {
+    Fiber *fiber = (Fiber*) argument;
+    fiber->task();
+    fiber->task = nullptr;
+    // Never resumed.
+    fiber->scheduler.suspend(*fiber);
+}
+
+void FiberScheduler::suspend(Fiber &fiber) {
+    // The invocation this fiber is inside, if any, is not current for the
+    // fibers that run meanwhile. Its deadline is armed again on resuming.
+    SandboxInvocation *invocation = NaClContext::exchange_invocation(nullptr);
+    sandbox_fiber_switch(&fiber.rsp, scheduler_rsp);
+    NaClContext::exchange_invocation(invocation);
+}
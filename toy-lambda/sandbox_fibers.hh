@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Runs tasks, typically sandbox invocations, as fibers on one thread, so a
+// task that waits on a host operation parks instead of blocking the thread
+// and the thread runs other tasks meanwhile. A fiber parks from anywhere,
+// including a host call made by sandboxed code: the sandbox's stack and
+// registers stay as they are on the invocation's own stack until the fiber
+// is woken and resumed.
+class FiberScheduler {
+public:
+    // A fiber, valid until its task returns.
+    class Fiber;
+
+    FiberScheduler();
+
+    // Fibers still parked are dropped without finishing.
+    ~FiberScheduler();
+
+    FiberScheduler(const FiberScheduler &other) = delete;
+    FiberScheduler& operator=(const FiberScheduler &other) = delete;
+
+    // Queues task to start on a fiber of its own. Called from the thread
+    // that calls run().
+    void spawn(std::function<void()> task);
+
+    // Runs ready fibers until every fiber is parked or finished. Only ever
+    // called from one thread.
+    void run();
+
+    // Fibers that have not finished.
+    size_t active() const { return fibers.size() - finished.size(); }
+
+    // Returns the fiber running on this thread, or nullptr.
+    static Fiber* current();
+
+    // Parks the running fiber until wake() is called for it. Returns at
+    // once if it was woken since it last parked.
+    static void park();
+
+    // Makes fiber ready to run again. Safe to call from any thread.
+    static void wake(Fiber *fiber);
+
+    // Parks the running fiber for duration, or sleeps outside fibers.
+    static void sleep_for(std::chrono::milliseconds duration);
+
+private:
+    // Host stack of each fiber. The invocations' sandbox stacks are the
+    // sandbox's own.
+    static const size_t stack_size = 256 * 1024;
+
+    static void start(void *fiber);
+
+    // Switches from the running fiber back to run().
+    void suspend(Fiber &fiber);
+
+    // Wakes one of this scheduler's fibers. Must hold lock.
+    void wake_locked(Fiber *fiber);
+
+    // Stack pointer of run() while a fiber runs.
+    void *scheduler_rsp = nullptr;
+
+    std::mutex lock;
+    std::deque<Fiber*> ready;
+    std::multimap<std::chrono::steady_clock::time_point, Fiber*> timers;
+
+    // Every fiber created, and the finished ones, whose stacks are reused
+    // by new ones. Only run() and spawn() touch these.
+    std::vector<std::unique_ptr<Fiber>> fibers;
+    std::vector<Fiber*> finished;
+};
@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include "sandbox_image.hh"
+#include "sandbox_slots.hh"
+#include "stats.hh"
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+using namespace std;
+
+namespace {
+
+const unsigned long page_size = 4096;
+
+Counter &shared_images = stats_counter("nacl_shared_images");
+
+// Live images by hash. Entries expire with the last context using them.
+mutex images_lock;
+multimap<uint64_t, weak_ptr<SandboxImage>> images;
+
+unsigned long page_floor(unsigned long value) {
+    return value / page_size * page_size;
+}
+
+unsigned long page_ceil(unsigned long value) {
+    return page_floor(value + page_size - 1);
+}
+
+// Returns the FNV-1a hash of data, continuing from hash.
+uint64_t hash_bytes(string_view data, uint64_t hash = 14695981039346656037ull) {
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Writes all of data to fd at offset. Returns false on failure.
+bool write_at(int fd, string_view data, unsigned long offset) {
+    while (!data.empty()) {
+        ssize_t written = pwrite(fd, data.data(), data.size(), offset);
+        if (written <= 0) {
+            perror("pwrite()");
+            return false;
+        }
+        data.remove_prefix(written);
+        offset += written;
+    }
+    return true;
+}
+
+// Copies the file from, whose contents are mapped at contents, into to. The
+// kernel does the copy where it can. Returns false on failure.
+bool copy_file(int from, int to, string_view contents) {
+    loff_t in = 0;
+    loff_t out = 0;
+    while (out < (loff_t) contents.size()) {
+        ssize_t copied = copy_file_range(from, &in, to, &out, contents.size() - out, 0);
+        if (copied <= 0) {
+            // Older kernels cannot copy between file systems.
+            return write_at(to, contents.substr(out), out);
+        }
+    }
+    return true;
+}
+
+// Maps a file read-only, or returns nothing.
+optional<string_view> map_file(int fd, unsigned long size) {
+    if (size == 0) {
+        return string_view();
+    }
+    void *contents = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (contents == MAP_FAILED) {
+        perror("mmap()");
+        return {};
+    }
+    return string_view((const char*) contents, size);
+}
+
+void unmap_file(string_view contents) {
+    if (!contents.empty()) {
+        munmap((void*) contents.data(), contents.size());
+    }
+}
+
+}
+
+shared_ptr<SandboxImage> SandboxImage::share(const string &path,
+                                             const vector<SandboxSegment> &segments,
+                                             string_view code, unsigned long code_offset) {
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file == -1) {
+        perror(path.c_str());
+        return nullptr;
+    }
+    struct stat status;
+    if (fstat(file, &status) != 0) {
+        perror("fstat()");
+        close(file);
+        return nullptr;
+    }
+    optional<string_view> contents = map_file(file, status.st_size);
+    if (!contents.has_value()) {
+        close(file);
+        return nullptr;
+    }
+
+    for (const SandboxSegment &segment : segments) {
+        if (segment.file_size > 0 && segment.file_offset + segment.file_size > contents->size()) {
+            cerr << "Error: a segment of " << path << " runs past the end of the file." << endl;
+            unmap_file(*contents);
+            close(file);
+            return nullptr;
+        }
+    }
+
+    shared_ptr<SandboxImage> image;
+    // The host-call table is part of the image, and it changes as host
+    // calls are registered.
+    uint64_t hash = hash_bytes(code, hash_bytes(*contents));
+    {
+        lock_guard<mutex> guard(images_lock);
+        for (auto [it, end] = images.equal_range(hash); it != end; ) {
+            shared_ptr<SandboxImage> candidate = it->second.lock();
+            if (candidate == nullptr) {
+                it = images.erase(it);
+                continue;
+            }
+            if (candidate->holds(*contents, code, code_offset)) {
+                image = candidate;
+                break;
+            }
+            ++it;
+        }
+    }
+    if (image != nullptr) {
+        unmap_file(*contents);
+        close(file);
+        shared_images.add();
+        return image;
+    }
+
+    int fd = memfd_create("nacl-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        perror("memfd_create()");
+        unmap_file(*contents);
+        close(file);
+        return nullptr;
+    }
+    image.reset(new SandboxImage(fd, contents->size(), string(code), code_offset));
+
+    bool copied = copy_file(file, fd, *contents);
+    unsigned long next_offset = page_ceil(contents->size());
+    for (const SandboxSegment &segment : segments) {
+        unsigned long start = page_floor(segment.address);
+        unsigned long data_end = segment.address + segment.file_size;
+        unsigned long full_end = segment.memory_size > segment.file_size ?
+            page_floor(data_end) : page_ceil(data_end);
+        if (full_end > start) {
+            image->mappings.push_back(Mapping{
+                start, full_end - start, page_floor(segment.file_offset), segment.protection, false});
+        }
+
+        // The page where the data ends and the bss starts comes from a copy
+        // with the bytes after the data zeroed.
+        if (segment.file_size > 0 && full_end < data_end) {
+            unsigned long tail_offset = segment.file_offset + segment.file_size - (data_end - full_end);
+            copied = copied && write_at(fd, contents->substr(tail_offset, data_end - full_end),
+                                        next_offset);
+            image->mappings.push_back(
+                Mapping{full_end, page_size, next_offset, segment.protection, false});
+            next_offset += page_size;
+        }
+
+        unsigned long bss_start = segment.file_size == 0 ? start : page_ceil(data_end);
+        unsigned long end = page_ceil(segment.address + segment.memory_size);
+        if (end > bss_start) {
+            image->mappings.push_back(Mapping{bss_start, end - bss_start, 0, segment.protection, true});
+        }
+        if (segment.protection & PROT_WRITE) {
+            image->writable += end - start;
+        }
+        image->segments_end = max(image->segments_end, end);
+    }
+    copied = copied && write_at(fd, code, next_offset + code_offset % page_size);
+    image->mappings.push_back(Mapping{
+        page_floor(code_offset), page_ceil(code_offset % page_size + code.size()),
+        next_offset, PROT_READ | PROT_EXEC, false});
+    next_offset += page_ceil(code_offset % page_size + code.size());
+
+    unmap_file(*contents);
+    close(file);
+    if (!copied) {
+        return nullptr;
+    }
+
+    // Sandboxes from other tenants map the same pages, so nobody may change
+    // them from here on.
+    if (ftruncate(fd, next_offset) != 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        perror("sealing the image");
+        return nullptr;
+    }
+
+    lock_guard<mutex> guard(images_lock);
+    images.emplace(hash, image);
+    return image;
+}
+
+SandboxImage::~SandboxImage() {
+    close(fd);
+}
+
+bool SandboxImage::map(char *slot) const {
+    if (mmap(slot, sandbox_slot_size, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+        perror("mmap()");
+        return false;
+    }
+
+    for (const Mapping &mapping : mappings) {
+        if (mapping.zero_filled) {
+            if (mprotect(slot + mapping.address, mapping.size, mapping.protection) != 0) {
+                perror("mprotect()");
+                return false;
+            }
+            continue;
+        }
+
+        int flags = mapping.protection & PROT_WRITE ? MAP_PRIVATE : MAP_SHARED;
+        if (mmap(slot + mapping.address, mapping.size, mapping.protection, flags | MAP_FIXED,
+                 fd, mapping.offset) == MAP_FAILED) {
+            perror("mmap()");
+            return false;
+        }
+    }
+    return true;
+}
+
+unsigned long SandboxImage::accessible_end(unsigned long offset, int protection) const {
+    for (const Mapping &mapping : mappings) {
+        if (offset >= mapping.address && offset < mapping.address + mapping.size &&
+            (mapping.protection & protection) == protection) {
+            return mapping.address + mapping.size;
+        }
+    }
+    return 0;
+}
+
+bool SandboxImage::holds(string_view contents, string_view other_code,
+                         unsigned long other_code_offset) const {
+    if (contents.size() != file_size || other_code != code || other_code_offset != code_offset) {
+        return false;
+    }
+
+    optional<string_view> image = map_file(fd, file_size);
+    if (!image.has_value()) {
+        return false;
+    }
+    bool same = *image == contents;
+    unmap_file(*image);
+    return same;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// A loadable segment of a sandboxed binary, from a PT_LOAD program header.
+struct SandboxSegment {
+    // Where the segment goes in the slot, and how much memory it takes.
+    unsigned long address;
+    unsigned long memory_size;
+
+    // Where its initialized bytes are in the file. The rest of memory_size
+    // is zero-filled.
+    unsigned long file_offset;
+    unsigned long file_size;
+
+    std::string code;
+    unsigned long code_offset;
+
+    // PROT_READ, PROT_WRITE and PROT_EXEC bits.
+    int protection;
+};
+
+// The pristine contents of a sandbox, in a sealed memfd holding the binary
+// as it is on disk. Segments are mapped straight from it at their slot
+// addresses, so nothing is copied into the slot and the kernel pages the
+// binary in lazily. Identical binaries share one image, so the page cache
+// holds its pages once however many contexts map it, and each context only
+// pays for the pages it writes.
+class SandboxImage {
+public:
+    // Returns an image of the binary at path with the given segments, plus
+    // code placed at code_offset in the slot, reusing a live image of an
+    // identical binary if there is one. Returns nullptr on failure.
+    static std::shared_ptr<SandboxImage> share(const std::string &path,
+                                               const std::vector<SandboxSegment> &segments,
+                                               std::string_view code, unsigned long code_offset);
+
+    ~SandboxImage();
+
+    SandboxImage(const SandboxImage &other) = delete;
+    SandboxImage& operator=(const SandboxImage &other) = delete;
+
+    // Replaces the mappings of slot with the image. Memory outside the
+    // segments is reserved but inaccessible. Writable segments are private
+    // copies, so dropping a written page brings the image's page back; the
+    // others are shared. Returns false on failure.
+    bool map(char *slot) const;
+
+    // Bytes of the slot that writable segments, including their bss, take.
+    unsigned long writable_size() const { return writable; }
+
+    // Returns the end of the mapped region that contains offset, whose pages
+    // all allow protection, or 0 if there is none.
+    unsigned long accessible_end(unsigned long offset, int protection) const;
+
+    // The first page-aligned offset after every segment.
+    unsigned long end() const { return segments_end; }
+
+private:
+    // A range of the slot backed by the memfd, or zero-filled.
+    struct Mapping {
+        unsigned long address;
+        unsigned long size;
+        unsigned long offset;
+        int protection;
+        bool zero_filled;
+    };
+
+    SandboxImage(int fd, unsigned long file_size, std::string code, unsigned long code_offset) :
+        fd(fd), file_size(file_size), code(std::move(code)), code_offset(code_offset) {}
+
+    // Returns whether the image holds the same binary as contents, and the
+    // same code at code_offset.
+    bool holds(std::string_view contents, std::string_view code, unsigned long code_offset) const;
+
+    int fd;
+
+    // The binary's size. The memfd holds it first, then zero-filled copies
+    // of the pages where segments end part way, then the extra code.
+    unsigned long file_size;
+
+    std::string code;
+    unsigned long code_offset;
+
+    std::vector<Mapping> mappings;
+    unsigned long writable = 0;
+    unsigned long segments_end = 0;
+};
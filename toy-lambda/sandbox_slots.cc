@@ -0,0 +1,83 @@
+#include <cstdio>
+#include <cstdint>
+#include "sandbox_slots.hh"
+
+extern "C" {
+#include <sys/mman.h>
+}
+
+using namespace std;
+
+namespace {
+
+const unsigned long slot_stride = sandbox_slot_size + sandbox_guard_size;
+
+}
+
+SandboxSlotAllocator& SandboxSlotAllocator::instance() {
+    static SandboxSlotAllocator allocator;
+    return allocator;
+}
+
+char* SandboxSlotAllocator::allocate() {
+    lock_guard<mutex> guard(lock);
+    if (!free_slots.empty()) {
+        char *slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+
+    if (next_slot == chunk_end && !reserve_chunk()) {
+        return nullptr;
+    }
+
+    char *slot = next_slot;
+    next_slot += slot_stride;
+
+    // Only replaces part of our own reservation. MAP_NORESERVE, because
+    // sandboxes touch a tiny part of their 4GB.
+    if (mmap(slot, sandbox_slot_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+        perror("mmap()");
+        return nullptr;
+    }
+    return slot;
+}
+
+void SandboxSlotAllocator::release(char *slot) {
+    // Drops the pages but keeps the mapping, so the slot comes back zeroed
+    // without changing the process's memory map.
+    if (madvise(slot, sandbox_slot_size, MADV_DONTNEED) != 0) {
+        perror("madvise()");
+        return;
+    }
+
+    lock_guard<mutex> guard(lock);
+    free_slots.push_back(slot);
+}
+
+bool SandboxSlotAllocator::reserve_chunk() {
+    // Over-reserve by one slot so the chunk can start 4GB-aligned. The
+    // leading guard keeps the first slot apart from whatever comes before.
+    const unsigned long chunk_size = sandbox_guard_size + sandbox_slots_per_chunk * slot_stride;
+    const unsigned long reservation_size = chunk_size + sandbox_slot_size;
+    char *reservation = (char*) mmap(nullptr, reservation_size, PROT_NONE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED) {
+        perror("mmap()");
+        return false;
+    }
+
+    uintptr_t aligned = ((uintptr_t) reservation + sandbox_slot_size - 1) & ~(sandbox_slot_size - 1);
+    char *chunk = (char*) aligned;
+    if (chunk > reservation) {
+        munmap(reservation, chunk - reservation);
+    }
+    if (reservation + reservation_size > chunk + chunk_size) {
+        munmap(chunk + chunk_size, reservation + reservation_size - (chunk + chunk_size));
+    }
+
+    next_slot = chunk + sandbox_guard_size;
+    chunk_end = chunk + chunk_size;
+    return true;
+}
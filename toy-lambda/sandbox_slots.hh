@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// The address space of one sandbox. Sandboxed code addresses it with 32-bit
+// offsets from r15.
+const unsigned long sandbox_slot_size = 1UL << 32;
+
+// Inaccessible space after every slot, shared with the next slot. Catches
+// accesses that run past a 32-bit offset, such as r15 + offset + displacement.
+const unsigned long sandbox_guard_size = 1UL << 32;
+
+// Slots reserved by each reservation of address space.
+const size_t sandbox_slots_per_chunk = 64;
+
+// Hands out 4GB-aligned sandbox slots from large PROT_NONE reservations of
+// our own, so placing a slot with MAP_FIXED never replaces someone else's
+// mapping. Released slots are emptied and recycled without being unmapped.
+// Safe to use from any thread.
+class SandboxSlotAllocator {
+public:
+    static SandboxSlotAllocator& instance();
+
+    SandboxSlotAllocator(const SandboxSlotAllocator &other) = delete;
+    SandboxSlotAllocator& operator=(const SandboxSlotAllocator &other) = delete;
+
+    // Returns the base of a zero-filled, readable, writable and executable
+    // slot, or nullptr once the address space is exhausted.
+    char* allocate();
+
+    // Discards the slot's contents and makes it available again.
+    void release(char *slot);
+
+private:
+    SandboxSlotAllocator() = default;
+
+    // Reserves a chunk of sandbox_slots_per_chunk slots. Returns false on
+    // failure.
+    bool reserve_chunk();
+
+    std::mutex lock;
+
+    // Accessible slots that were released.
+    std::vector<char*> free_slots;
+
+    // The next never-used slot of the current chunk, and the end of the chunk.
+    char *next_slot = nullptr;
+    char *chunk_end = nullptr;
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Routines in sandbox_switch.S.
+extern "C" {
+
+// Calls target(args[0], ..., args[5]) in the sandbox at base and returns
+// what it returns. r15 holds base while sandboxed code runs, on the stack
+// ending at stack_top, which must be 16-byte aligned. The call goes through
+// trampoline, a copy of sandbox_trampoline_code() in the sandbox, and
+// target must be 32-byte aligned. No host address is left on the stack or
+// in the general-purpose registers sandboxed code sees. Callee-saved
+// registers, MXCSR and the x87 control word are restored afterwards,
+// whatever the sandbox did with them, and sandboxed code starts from the
+// default MXCSR and x87 control word. May be nested through host calls.
+uint64_t sandbox_enter(char *base, const char *trampoline, const char *target, char *stack_top,
+                       const uint64_t *args);
+
+// Returns from the innermost sandbox_enter() on this thread, whatever the
+// stack, as if its target had returned rax. Sandboxed code that must stop
+// early is sent here from a signal handler.
+void sandbox_exit();
+
+// The offset from the thread pointer of the host stack pointer that
+// sandbox_enter() keeps for this thread. It is fixed when the server is
+// linked, so unlike a host address it tells sandboxed code nothing. While
+// sandboxed code runs, the addresses of sandbox_exit and sandbox_host_call
+// are 16 and 24 bytes above the host stack pointer.
+int64_t sandbox_host_rsp_offset();
+
+// Where every host-call entry goes, with the host stack pointer in r11 and
+// the entry's index in eax. Calls sandbox_host_thunks[index], a function
+// such as HostThunk::call() that takes and returns the SysV registers. The
+// function runs on the host stack of the innermost sandbox_enter(), so no
+// host frame is ever in memory sandboxed code can reach, and returns to the
+// caller through a return address masked into the sandbox. Scratch
+// registers are cleared on the way back. The only sandbox memory the code
+// between sandbox_host_call and sandbox_host_call_end touches itself is the
+// return address, once back on the sandbox's stack.
+void sandbox_host_call();
+extern const char sandbox_host_call_end[];
+
+// The functions sandbox_host_call() calls, by entry index. Defined in
+// host_calls.cc, and kept in host memory so entries need not name them.
+extern uintptr_t sandbox_host_thunks[];
+
+// Saves the callee-saved registers, MXCSR, the x87 control word and the
+// host stack pointer sandbox_enter() keeps for this thread on the current
+// stack, stores the stack pointer at save, and restores the same from the
+// stack saved at resume. Switches between fibers, including ones that are
+// in the middle of sandboxed code.
+void sandbox_fiber_switch(void **save, void *resume);
+
+// A new fiber's stack starts with a frame for sandbox_fiber_switch() to
+// resume, laid out from resume upwards as: MXCSR and the x87 control word,
+// the host stack pointer, r15, r14, r13 holding a function, r12 holding its
+// argument, rbx, rbp, and the address of sandbox_fiber_start, ending at a
+// 16-byte aligned address. The function must not return.
+void sandbox_fiber_start();
+
+// The trampoline's code, with an empty 32-bit slot for
+// sandbox_host_rsp_offset() at sandbox_trampoline_tls. See
+// sandbox_trampoline_code().
+extern const char sandbox_trampoline[];
+extern const char sandbox_trampoline_tls[];
+extern const char sandbox_trampoline_end[];
+
+}
+
+// Returns what sandbox_enter() expects at trampoline. It must be placed at
+// a 32-byte aligned address.
+inline std::string sandbox_trampoline_code() {
+    std::string code(sandbox_trampoline, sandbox_trampoline_end);
+    int32_t offset = (int32_t) sandbox_host_rsp_offset();
+    memcpy(&code[sandbox_trampoline_tls - sandbox_trampoline], &offset, sizeof(offset));
+    return code;
+}
@@ -1,44 +1,121 @@
 // Based on the code from V8's embedding example.
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cctype>
+#include <cmath>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <sstream>
+#include <thread>
 #include "include/libplatform/libplatform.h"
 #include "include/v8.h"
+#include "function_cache.hh"
+#include "host_calls.hh"
+#include "isolate_pool.hh"
+#include "kv_store.hh"
+#include "native_worker_pool.hh"
+#include "process_pool.hh"
+#include "rcu.hh"
+#include "reloader.hh"
+#include "route_table.hh"
+#include "sandbox_fibers.hh"
+#include "stats.hh"
 #include "tcp_socket.hh"
 #include "nacl_loader.hh"
-
-extern "C" {
-#include <dlfcn.h>
-}
+#include "wasm_runtime.hh"
 
 // This should never need used.
 std::unique_ptr<v8::Platform> platform;
 
-// Relates page names to JavaScript functions to produce their body.
-// Readonly after initialization.
-std::map<std::string, std::string> page_to_js_function;
+// How long the server waits for a connection before it counts as idle.
+const std::chrono::milliseconds idle_poll_interval(1);
+
+// The most time spent on idle GC work before checking for connections again.
+const std::chrono::milliseconds idle_task_budget(2);
+
+// Reuses isolates across requests. Created after V8 is initialized.
+std::unique_ptr<IsolatePool> isolate_pool;
+
+// Worker processes forked for each native function in the process tier.
+const unsigned int processes_per_function = 2;
+
+// Runs the WebAssembly resources. Created after V8 is initialized.
+std::unique_ptr<WasmWorker> wasm_worker;
+
+// Runs the functions in dynamic libraries, one private instance per worker.
+std::unique_ptr<NativeWorkerPool> native_pool;
+
+// Relates pages to the functions that produce their body. Replaced by
+// reload_routes(), and read only by the main thread, which reports a
+// quiescent state to route_rcu once per event loop turn.
+std::atomic<const RouteTable*> routes;
+
+// Defers freeing replaced route tables until the main thread is done with them.
+QSBRDomain route_rcu;
+
+// Reloads the routes when the manifest, limits.conf or a function directory
+// change.
+std::unique_ptr<Reloader> reloader;
+
+// Lists the functions to route when present. Otherwise, every file in
+// resources/ and build/lib/ is routed.
+const std::string manifest_path = "functions.manifest";
+
+// The memory loaded functions may hold before idle ones are evicted.
+const size_t function_cache_budget = 1024UL * 1024UL * 1024UL;
+
+// Estimated memory of a JS function's isolate, which is created on its first
+// call. Most of it is V8's heap reservation.
+const size_t js_isolate_footprint = 4UL * 1024UL * 1024UL;
+
+// Functions materialized by their first request. Created after V8 is
+// initialized.
+std::unique_ptr<FunctionCache> function_cache;
 
-// Relates page names to dynamic libraries to produce their body.
-// Readonly after initialization.
-std::map<std::string, void*> page_to_dl_handle;
+// Estimated memory of a NaCl function's stack and heap, on top of its image.
+const size_t nacl_context_footprint = 64UL * 1024UL;
 
-// Relates page names to nacl contexts.
-// Readonly after initialization.
-std::map<std::string, std::unique_ptr<NaClContext>> page_to_nacl_context;
+// Runs NaCl invocations on the main thread as fibers, so an invocation
+// waiting in a host call lets the others run.
+FiberScheduler nacl_fibers;
+
+// NaCl invocations started and not finished, by sandbox. A sandbox is reset
+// once none are left.
+std::map<NaClContext*, unsigned int> nacl_in_flight;
 
 // Initializes V8.
 static void initialize_v8(const char *location);
 
-// Initializes JS resources.
-static void initialize_resources();
+// Registers the host calls NaCl functions may make besides lookup and sbrk.
+// Must run before any sandbox is created.
+static void register_host_calls();
+
+// Builds a route table from limits.conf and the manifest, or the function
+// directories without one, and publishes it. Nothing is loaded: functions
+// whose files changed are reloaded by their next request. Returns false if
+// the manifest or limits.conf are malformed, in which case the current
+// routes stay.
+static bool reload_routes();
+
+// Loads the runtime state of a function. Returns nothing if it fails to load.
+static std::optional<LoadedFunction> materialize_function(const std::string &page,
+                                                          const FunctionRoute &route,
+                                                          const FunctionLimits &limits,
+                                                          bool process_tier);
+
+// Drops runtime state owned outside the function cache.
+static void evict_function(const std::string &page, LoadedFunction &function);
+
+// Returns the histogram of request latencies for a runtime, split by whether
+// the request had to load its function.
+static Histogram& function_latency_histogram(FunctionRoute::Runtime runtime, bool cold);
 
 // Returns the resource being accessed in the request.
 static std::string get_resource(const std::string &request);
@@ -46,25 +123,51 @@ static std::string get_resource(const std::string &request);
 // Handles a HTTP request.
 static void handle_request(TCPSocket client);
 
+// Handles a HTTP request for a routed function, loading it if needed.
+static void handle_function_request(TCPSocket client, const RouteTable &table,
+                                    const std::string &resource, const FunctionRoute &route,
+                                    const std::string &request);
+
 // Handles a HTTP request for a JS resource.
-static void handle_js_request(TCPSocket client, const std::string &resource);
+static void handle_js_request(TCPSocket client, const RouteTable &table,
+                              const std::string &resource, const std::string &source,
+                              const std::string &request, RequestTimer timer);
+
+// Handles a HTTP request for a WebAssembly resource.
+static void handle_wasm_request(TCPSocket client, const std::string &resource,
+                                RequestTimer timer);
 
-static void handle_dl_request(TCPSocket client, const std::string &resource);
+// Responds with the server's metrics.
+static void handle_stats_request(TCPSocket client);
 
 int main(int argc, char* argv[]) {
+  // Before any thread exists, so that process-pool workers are forked from
+  // a single-threaded process.
+  if (!ProcessPool::start_zygote()) {
+    return 1;
+  }
+  if (!reload_routes()) {
+    return 1;
+  }
+  native_pool = NativeWorkerPool::create(std::max(1u, std::thread::hardware_concurrency()));
+  native_pool->start();
+
   initialize_v8(argv[0]);
-  initialize_resources();
+  register_host_calls();
+  function_cache = std::make_unique<FunctionCache>(function_cache_budget, evict_function);
 
-  page_to_nacl_context["a.out"] = NaClContext::create_context("native_client_bin/a.out");
-  if (page_to_nacl_context["a.out"] == nullptr) {
+  std::unique_ptr<NaClContext> sandbox =
+    NaClContext::create_context("native_client_bin/a.out", FunctionLimits().memory_limit,
+                                FunctionLimits().deadline, FunctionLimits().instruction_budget);
+  if (sandbox == nullptr) {
     std::cerr << "Could not allocate native client sandbox." << std::endl;
     return 1;
   }
 
   std::cout << "Created sandbox." << std::endl;
-  std::cout << "Sandbox output: " << page_to_nacl_context["a.out"]->call().value() << std::endl;
+  std::cout << "Sandbox output: " << sandbox->call<std::string_view()>().value() << std::endl;
   std::cout << "This verifies the sandbox is provisioned and can execute client code." << std::endl;
-  
+  sandbox.reset();
 
   std::optional<TCPSocket> socket = TCPSocket::open("0.0.0.0", 8080);
   if (!socket.has_value()) {
@@ -72,7 +175,24 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  QSBRDomain::Reader &route_reader = route_rcu.register_reader();
+  reloader = Reloader::create({".", "resources/", "build/lib/", "native_client_bin/"}, [] { reload_routes(); });
+  if (reloader == nullptr) {
+    return 1;
+  }
+
   while (true) {
+    route_reader.quiescent();
+
+    // Settle async JS calls and resume woken NaCl invocations, and move GC
+    // work into the gaps between requests.
+    isolate_pool->pump();
+    nacl_fibers.run();
+    if (!socket.value().wait_readable(idle_poll_interval)) {
+      isolate_pool->run_idle_tasks(idle_task_budget);
+      continue;
+    }
+
     std::optional<TCPSocket> client = socket.value().accept();
     if (!client.has_value()) {
       std::cerr << "Could not accept(): " << strerror(errno) << std::endl;
@@ -89,30 +209,178 @@ static void initialize_v8(const char *location) {
   platform = v8::platform::NewDefaultPlatform();
   v8::V8::InitializePlatform(platform.get());
   v8::V8::Initialize();
+  isolate_pool = std::make_unique<IsolatePool>(platform.get());
+  wasm_worker = std::make_unique<WasmWorker>(platform.get());
+}
+
+// void log(const char *message): writes message to stderr.
+static void host_log(NaClContext &sandbox, uint32_t message) {
+  std::optional<std::string_view> text = sandbox.string_at(message);
+  if (text.has_value()) {
+    std::cerr << "Sandbox: " << *text << std::endl;
+  }
+}
+
+// void sleep_ms(uint32_t milliseconds): parks the invocation for a while.
+static void host_sleep_ms(NaClContext &sandbox, uint32_t milliseconds) {
+  FiberScheduler::sleep_for(std::chrono::milliseconds(milliseconds));
+}
+
+// uint64_t clock_us(void): the server's monotonic clock, in microseconds.
+static uint64_t host_clock_us(NaClContext &sandbox) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// int64_t kv_get(const char *key): the number JS's host.kvGet() would see
+// under key, truncated to an integer, or 0.
+static int64_t host_kv_get(NaClContext &sandbox, uint32_t key) {
+  std::optional<std::string_view> name = sandbox.string_at(key);
+  if (!name.has_value()) {
+    return 0;
+  }
+  double value = KVStore::instance().get(*name);
+  return std::isfinite(value) && std::fabs(value) < 0x1p63 ? static_cast<int64_t>(value) : 0;
+}
+
+// void kv_set(const char *key, int64_t value): stores value under key, where
+// JS's host.kvGet() sees it too.
+static void host_kv_set(NaClContext &sandbox, uint32_t key, int64_t value) {
+  std::optional<std::string_view> name = sandbox.string_at(key);
+  if (name.has_value()) {
+    KVStore::instance().set(*name, static_cast<double>(value));
+  }
 }
 
-// Initializes all resources.
-static void initialize_resources() {
-  for (const auto &entry : std::filesystem::directory_iterator("resources/")) {
-    if (entry.is_regular_file()) {
-      std::ifstream file(entry.path());
-      std::stringstream file_contents;
-      file_contents << file.rdbuf();
-      page_to_js_function[entry.path().filename()] = file_contents.str();
+static void register_host_calls() {
+  HostCallTable::instance().add<host_log>("log");
+  HostCallTable::instance().add<host_clock_us>("clock_us");
+  HostCallTable::instance().add<host_kv_get>("kv_get");
+  HostCallTable::instance().add<host_kv_set>("kv_set");
+  // Parks on the main thread's fibers.
+  HostCallTable::instance().add<host_sleep_ms>("sleep_ms", false);
+}
+
+static bool reload_routes() {
+  auto start = std::chrono::steady_clock::now();
+  auto next = std::make_unique<RouteTable>();
+
+  std::optional<FunctionLimitsTable> limits = FunctionLimitsTable::load("limits.conf");
+  if (!limits.has_value()) {
+    return false;
+  }
+  next->limits = std::move(limits.value());
+
+  if (std::filesystem::exists(manifest_path)) {
+    std::optional<std::map<std::string, FunctionRoute>> manifest = load_manifest(manifest_path);
+    if (!manifest.has_value()) {
+      return false;
     }
+    next->functions = std::move(manifest.value());
+  } else {
+    next->functions = scan_function_directories();
   }
 
-  for (const auto &entry : std::filesystem::directory_iterator("build/lib/")) {
-    void *handle = dlopen(entry.path().c_str(), RTLD_NOW);
-    if (!handle) {
-      std::cerr << "Unable to dlopen(): " << strerror(errno) << std::endl;
-      std::exit(1);
+  const RouteTable *previous = routes.exchange(next.release());
+  if (previous != nullptr) {
+    route_rcu.synchronize();
+    delete previous;
+  }
+
+  stats_histogram("route_reload_us").record(std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start).count());
+  return true;
+}
+
+static std::optional<LoadedFunction> materialize_function(const std::string &page,
+                                                          const FunctionRoute &route,
+                                                          const FunctionLimits &limits,
+                                                          bool process_tier) {
+  LoadedFunction function;
+  function.runtime = route.runtime;
+  function.version = route.version;
+
+  std::error_code error;
+  size_t file_size = std::filesystem::file_size(route.path, error);
+  if (error) {
+    std::cerr << "Unable to load " << route.path << ": " << error.message() << std::endl;
+    return {};
+  }
+
+  switch (route.runtime) {
+  case FunctionRoute::js: {
+    std::ifstream file(route.path, std::ios::binary);
+    std::stringstream file_contents;
+    file_contents << file.rdbuf();
+    function.js_source = file_contents.str();
+    function.bytes = function.js_source.size() + js_isolate_footprint;
+    break;
+  }
+  case FunctionRoute::wasm: {
+    std::ifstream file(route.path, std::ios::binary);
+    std::stringstream file_contents;
+    file_contents << file.rdbuf();
+    if (!wasm_worker->load_module(page, file_contents.str())) {
+      return {};
+    }
+    // Compiled code takes a few times the wire bytes.
+    function.bytes = 4 * file_size;
+    break;
+  }
+  case FunctionRoute::native:
+    if (process_tier) {
+      std::string name = page.substr(process_route_prefix.length());
+      function.process_pool = ProcessPool::create(name, route.path, processes_per_function,
+                                                  limits.deadline);
+      if (function.process_pool == nullptr) {
+        return {};
+      }
+      function.process_pool->start();
+      function.bytes = processes_per_function * (file_size + sizeof(ShmRing) * 2);
+    } else {
+      function.native_library = native_pool->load(page, route.path);
+      if (function.native_library == nullptr) {
+        return {};
+      }
+      function.bytes = native_pool->worker_count() * file_size;
+    }
+    break;
+  case FunctionRoute::nacl:
+    function.nacl_context = NaClContext::create_context(route.path, limits.memory_limit,
+                                                        limits.deadline, limits.instruction_budget);
+    if (function.nacl_context == nullptr) {
+      return {};
     }
+    function.bytes = file_size + nacl_context_footprint;
+    break;
+  }
+  return function;
+}
 
-    page_to_dl_handle[entry.path().filename()] = handle;
+static void evict_function(const std::string &page, LoadedFunction &function) {
+  if (function.runtime == FunctionRoute::js) {
+    isolate_pool->evict(page);
+  } else if (function.runtime == FunctionRoute::wasm) {
+    wasm_worker->unload(page);
   }
 }
 
+static Histogram& function_latency_histogram(FunctionRoute::Runtime runtime, bool cold) {
+  static const std::array<std::array<Histogram*, 2>, 4> histograms = [] {
+    const std::array<const char*, 4> runtime_names = {"js", "wasm", "native", "nacl"};
+    std::array<std::array<Histogram*, 2>, 4> histograms;
+    for (size_t runtime = 0; runtime < histograms.size(); runtime++) {
+      for (int cold = 0; cold < 2; cold++) {
+        histograms[runtime][cold] = &stats_histogram(
+          std::string("function_latency_us{runtime=\"") + runtime_names[runtime] +
+          "\",start=\"" + (cold ? "cold" : "warm") + "\"}");
+      }
+    }
+    return histograms;
+  }();
+  return *histograms[runtime][cold];
+}
+
 static std::string get_resource(const std::string &request) {
   if (request.length() == 0) {
     return "";
@@ -138,15 +406,30 @@ static std::string get_resource(const std::string &request) {
   return request_str;
 }
 
-static void handle_sandbox_request(TCPSocket client, const std::string &resource) {
-  std::unique_ptr<NaClContext> &sandbox = page_to_nacl_context[resource];
-  std::optional<std::string> result = sandbox->call();
-  if (!result.has_value()) {
-    std::cout << "PROBLEM" << std::endl;
-    client.write("HTTP/1.1 500 Internal Server Error");
-  } else {
-    client.write("HTTP/1.1 200 OK\r\n\r\n" + result.value());
-  }
+static void handle_sandbox_request(TCPSocket client, std::shared_ptr<NaClContext> sandbox,
+                                   RequestTimer timer) {
+  nacl_in_flight[sandbox.get()]++;
+  nacl_fibers.spawn([client, sandbox, timer]() mutable {
+    std::optional<std::string_view> result = sandbox->call<std::string_view()>();
+    if (!result.has_value() && NaClContext::last_call_timed_out()) {
+      client.write("HTTP/1.1 503 Service Unavailable\r\n");
+    } else if (!result.has_value()) {
+      std::cout << "PROBLEM" << std::endl;
+      client.write("HTTP/1.1 500 Internal Server Error");
+    } else {
+      client.write("HTTP/1.1 200 OK\r\n\r\n" + std::string(result.value()));
+    }
+    timer.finish();
+
+    // Nothing the calls left behind is visible to later callers.
+    if (--nacl_in_flight[sandbox.get()] == 0) {
+      nacl_in_flight.erase(sandbox.get());
+      sandbox->reset();
+    }
+  });
+
+  // Runs to completion unless it parks.
+  nacl_fibers.run();
 }
 
 static void handle_request(TCPSocket client) {
@@ -154,95 +437,97 @@ static void handle_request(TCPSocket client) {
   ssize_t nread = read(client, buffer.data(), buffer.size());
   std::string request_string(buffer.begin(), buffer.begin() + nread);
   std::string resource = get_resource(request_string);
-
-  if (page_to_js_function.contains(resource)) {
-    handle_js_request(client, resource);
-  } else if (page_to_dl_handle.contains(resource)) {
-    handle_dl_request(client, resource);
-  } else if (resource == "a.out") {
-    handle_sandbox_request(client, "a.out");
+  const RouteTable &table = *routes.load(std::memory_order_acquire);
+
+  // Process tier pages name a native function after the prefix.
+  bool process_tier = resource.starts_with(process_route_prefix);
+  auto route = table.functions.find(process_tier ?
+                                    resource.substr(process_route_prefix.length()) : resource);
+
+  if (route != table.functions.end() &&
+      (!process_tier || route->second.runtime == FunctionRoute::native)) {
+    handle_function_request(client, table, resource, route->second, request_string);
+  } else if (resource == "metrics") {
+    handle_stats_request(client);
+  } else if (resource == "admin/reload") {
+    reloader->request();
+    client.write("HTTP/1.1 202 Accepted\r\n");
   } else {
     client.write("HTTP/1.1 404 Not Found\r\n\r\nnot found");
   }
 }
 
-// Handles a HTTP request for a JS resource.
-static void handle_js_request(TCPSocket client, const std::string &resource) {
-  // Create a new Isolate and make it the current one.
-  v8::Isolate::CreateParams create_params;
-  create_params.array_buffer_allocator =
-    v8::ArrayBuffer::Allocator::NewDefaultAllocator();
-
-  v8::Isolate* isolate = v8::Isolate::New(create_params);
-  {
-    v8::Isolate::Scope isolate_scope(isolate);
-
-    // Create a stack-allocated handle scope.
-    v8::HandleScope handle_scope(isolate);
-
-    // Create a new context.
-    v8::Local<v8::Context> context = v8::Context::New(isolate);
-
-    // Enter the context for compiling.
-    v8::Context::Scope context_scope(context);
-
-    // Create a string containing the JavaScript source code.
-    v8::Local<v8::String> source =
-      v8::String::NewFromUtf8(isolate, page_to_js_function[resource].c_str(),
-                              v8::NewStringType::kNormal).ToLocalChecked();
-
-    // Compile the source code.
-    v8::Local<v8::Script> script =
-      v8::Script::Compile(context, source).ToLocalChecked();
-    script->Run(context).ToLocalChecked();
-
-    v8::MaybeLocal<v8::Value> maybe_main_func =
-      context->Global()->Get(context, v8::String::NewFromUtf8(isolate, "main")
-                         .ToLocalChecked());
-
-    if (maybe_main_func.IsEmpty()) {
+static void handle_function_request(TCPSocket client, const RouteTable &table,
+                                    const std::string &resource, const FunctionRoute &route,
+                                    const std::string &request) {
+  auto start = std::chrono::steady_clock::now();
+  LoadedFunction *function = function_cache->find(resource, route.version);
+  // A process pool that lost every worker is loaded again rather than used.
+  if (function != nullptr && function->process_pool != nullptr &&
+      function->process_pool->failed()) {
+    function = nullptr;
+  }
+  bool cold = function == nullptr;
+  if (cold) {
+    std::optional<LoadedFunction> loaded =
+      materialize_function(resource, route, table.limits.get(resource),
+                           resource.starts_with(process_route_prefix));
+    if (!loaded.has_value()) {
       client.write("HTTP/1.1 500 Internal Server Error\r\n");
       return;
     }
+    function = &function_cache->insert(resource, std::move(loaded.value()));
+  }
 
-    v8::Local<v8::Value> main_func = maybe_main_func.ToLocalChecked();
-    if (!main_func->IsFunction()) {
-      client.write("HTTP/1.1 500 Internal Server Error\r\n");
-      return;
-    }
+  RequestTimer timer(function_latency_histogram(route.runtime, cold), start);
 
-    v8::MaybeLocal<v8::Value> maybe_return_value =
-        main_func.As<v8::Function>()->Call(context, main_func, 0, nullptr);
-    if (maybe_return_value.IsEmpty()) {
-      client.write("HTTP/1.1 500 Internal Server Error\r\n");
-      return;
-    }
+  if (route.runtime == FunctionRoute::js) {
+    handle_js_request(client, table, resource, function->js_source, request, timer);
+  } else if (route.runtime == FunctionRoute::wasm) {
+    handle_wasm_request(client, resource, timer);
+  } else if (route.runtime == FunctionRoute::nacl) {
+    handle_sandbox_request(client, function->nacl_context, timer);
+  } else if (function->process_pool != nullptr) {
+    function->process_pool->submit(client, request, timer);
+  } else {
+    native_pool->submit(client, function->native_library, request, timer);
+  }
+}
 
-    v8::Local<v8::Value> rvalue = maybe_return_value.ToLocalChecked();
-    if (!rvalue->IsString()) {
+// Handles a HTTP request for a JS resource. If main() is async, the response
+// is written from the event loop once its Promise settles.
+static void handle_js_request(TCPSocket client, const RouteTable &table,
+                              const std::string &resource, const std::string &source,
+                              const std::string &request, RequestTimer timer) {
+  isolate_pool->call(resource, source, table.limits.get(resource), request,
+                     [client, timer](JSResult result) {
+    switch (result.status) {
+    case JSResult::ok:
+      client.write("HTTP/1.1 200 OK\r\n\r\n" + result.body);
+      break;
+    case JSResult::over_budget:
+    case JSResult::timed_out:
+      client.write("HTTP/1.1 503 Service Unavailable\r\n");
+      break;
+    default:
       client.write("HTTP/1.1 500 Internal Server Error\r\n");
-      return;
+      break;
     }
-
-    client.write("HTTP/1.1 200 OK\r\n\r\n" + std::string(*v8::String::Utf8Value(isolate, rvalue)));
-  }
-
-  // Dispose the isolate and tear down V8.
-  isolate->Dispose();
-  delete create_params.array_buffer_allocator;
+    timer.finish();
+  });
 }
 
-static void handle_dl_request(TCPSocket client, const std::string &resource) {
-  void *dl_handle = page_to_dl_handle[resource];
-
-  const char* (*http_main)(void) =
-    (const char* (*)(void)) dlsym(dl_handle, "http_main");
+static void handle_stats_request(TCPSocket client) {
+  client.write("HTTP/1.1 200 OK\r\n\r\n" + render_stats());
+}
 
-  if (!http_main) {
+static void handle_wasm_request(TCPSocket client, const std::string &resource,
+                                RequestTimer timer) {
+  std::optional<std::string> result = wasm_worker->call(resource);
+  if (!result.has_value()) {
     client.write("HTTP/1.1 500 Internal Server Error\r\n");
-    return;
+  } else {
+    client.write("HTTP/1.1 200 OK\r\n\r\n" + result.value());
   }
-
-  std::string response = http_main();
-  client.write("HTTP/1.1 200 OK\r\n\r\n" + response);
-}
\ No newline at end of file
+  timer.finish();
+}
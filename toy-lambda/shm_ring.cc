@@ -0,0 +1,85 @@
+#include <cerrno>
+#include <climits>
+#include "shm_ring.hh"
+
+extern "C" {
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+using namespace std;
+
+static_assert(atomic<uint32_t>::is_always_lock_free && sizeof(atomic<uint32_t>) == sizeof(uint32_t),
+              "futexes need plain 32-bit words");
+
+void ShmRing::reset() {
+    head.store(0);
+    tail.store(0);
+    consumer_sleeping.store(0);
+    producer_sleeping.store(0);
+}
+
+ShmRing::Slot* ShmRing::begin_push(chrono::milliseconds timeout) {
+    uint32_t next = head.load(memory_order_relaxed);
+    while (true) {
+        uint32_t oldest = tail.load(memory_order_acquire);
+        if (next - oldest < slot_count) {
+            return &slots[next % slot_count];
+        }
+        if (!wait(tail, producer_sleeping, oldest, timeout)) {
+            return nullptr;
+        }
+    }
+}
+
+void ShmRing::end_push() {
+    head.store(head.load(memory_order_relaxed) + 1, memory_order_seq_cst);
+    wake(head, consumer_sleeping);
+}
+
+ShmRing::Slot* ShmRing::begin_pop(chrono::milliseconds timeout) {
+    uint32_t oldest = tail.load(memory_order_relaxed);
+    while (true) {
+        uint32_t next = head.load(memory_order_acquire);
+        if (next != oldest) {
+            return &slots[oldest % slot_count];
+        }
+        if (!wait(head, consumer_sleeping, next, timeout)) {
+            return nullptr;
+        }
+    }
+}
+
+void ShmRing::end_pop() {
+    tail.store(tail.load(memory_order_relaxed) + 1, memory_order_seq_cst);
+    wake(tail, producer_sleeping);
+}
+
+bool ShmRing::wait(atomic<uint32_t> &word, atomic<uint32_t> &sleepers,
+                   uint32_t seen, chrono::milliseconds timeout) {
+    // Announce the sleep before the final check, so a concurrent wake() either
+    // sees the announcement or its store is seen here.
+    sleepers.store(1, memory_order_seq_cst);
+    if (word.load(memory_order_seq_cst) != seen) {
+        sleepers.store(0, memory_order_relaxed);
+        return true;
+    }
+
+    struct timespec relative = {
+        .tv_sec = static_cast<time_t>(timeout.count() / 1000),
+        .tv_nsec = static_cast<long>(timeout.count() % 1000 * 1000000),
+    };
+    // Not FUTEX_PRIVATE_FLAG: the word is shared with another process.
+    long result = syscall(SYS_futex, &word, FUTEX_WAIT, seen,
+                          timeout.count() < 0 ? nullptr : &relative, nullptr, 0);
+    sleepers.store(0, memory_order_relaxed);
+    return result == 0 || errno != ETIMEDOUT;
+}
+
+void ShmRing::wake(atomic<uint32_t> &word, atomic<uint32_t> &sleepers) {
+    if (sleepers.load(memory_order_seq_cst) != 0) {
+        syscall(SYS_futex, &word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
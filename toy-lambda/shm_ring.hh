@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// A single-producer, single-consumer ring of fixed-size messages, laid out to
+// live in memory shared between two processes. Empty and full rings are
+// waited on with futexes; a side only makes the wake-up system call when the
+// other side is asleep.
+class ShmRing {
+public:
+    static const uint32_t slot_count = 16;
+    static const size_t slot_capacity = 64 * 1024;
+
+    struct Slot {
+        // Meaning is up to the two sides, e.g. an M80_* code.
+        int32_t status;
+        uint32_t length;
+        char data[slot_capacity];
+    };
+
+    // Prepares a ring in freshly mapped memory.
+    void reset();
+
+    // Returns the next free slot, waiting up to timeout while the ring is
+    // full. A negative timeout waits forever. Returns nullptr on timeout.
+    Slot* begin_push(std::chrono::milliseconds timeout);
+
+    // Publishes the slot returned by begin_push().
+    void end_push();
+
+    // Returns the oldest published slot, waiting up to timeout while the
+    // ring is empty. A negative timeout waits forever. Returns nullptr on
+    // timeout.
+    Slot* begin_pop(std::chrono::milliseconds timeout);
+
+    // Releases the slot returned by begin_pop().
+    void end_pop();
+
+    bool empty() const { return head.load() == tail.load(); }
+
+private:
+    // Sleeps while word holds seen. Returns false on timeout, and true when
+    // woken, possibly spuriously.
+    static bool wait(std::atomic<uint32_t> &word, std::atomic<uint32_t> &sleepers,
+                     uint32_t seen, std::chrono::milliseconds timeout);
+
+    static void wake(std::atomic<uint32_t> &word, std::atomic<uint32_t> &sleepers);
+
+    // The futex the consumer sleeps on while the ring is empty. Written by
+    // the producer only.
+    alignas(64) std::atomic<uint32_t> head;
+    // Set around that sleep by the consumer's wait(), and read by the
+    // producer's wake() to skip the system call when nobody sleeps. Written
+    // by the consumer only.
+    alignas(64) std::atomic<uint32_t> consumer_sleeping;
+
+    // The futex the producer sleeps on while the ring is full. Written by
+    // the consumer only.
+    alignas(64) std::atomic<uint32_t> tail;
+    // Set around that sleep by the producer's wait(), and read by the
+    // consumer's wake(). Written by the producer only.
+    alignas(64) std::atomic<uint32_t> producer_sleeping;
+
+    Slot slots[slot_count];
+};
@@ -0,0 +1,124 @@
+#include <bit>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "stats.hh"
+
+namespace {
+
+// Metrics are registered from static initializers in other translation
+// units, so the registry must be constructed on first use.
+struct Registry {
+    std::mutex lock;
+    std::map<std::string, std::unique_ptr<Histogram>> histograms;
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::unique_ptr<Gauge>> gauges;
+};
+
+Registry& registry() {
+    static Registry registry;
+    return registry;
+}
+
+// Returns the metric family, which is the name without labels.
+std::string family(const std::string &name) {
+    return name.substr(0, name.find('{'));
+}
+
+// Emits the TYPE line the first time a family is rendered.
+void render_type(std::string &out, std::string &last_family, const std::string &name,
+                 const char *type) {
+    if (family(name) != last_family) {
+        last_family = family(name);
+        out += "# TYPE " + last_family + " " + type + "\n";
+    }
+}
+
+}
+
+void Histogram::record(uint64_t value) {
+    int bucket = std::min<int>(std::bit_width(value), bucket_count - 1);
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    total_count.fetch_add(1, std::memory_order_relaxed);
+    total_sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+std::string Histogram::sample_name(const std::string &suffix,
+                                   const std::string &extra_label) const {
+    size_t brace = name.find('{');
+    if (brace == std::string::npos) {
+        return name + suffix + (extra_label.empty() ? "" : "{" + extra_label + "}");
+    }
+
+    std::string labels = name.substr(brace + 1, name.length() - brace - 2);
+    if (!extra_label.empty()) {
+        labels += "," + extra_label;
+    }
+    return name.substr(0, brace) + suffix + "{" + labels + "}";
+}
+
+void Histogram::render(std::string &out) const {
+    uint64_t cumulative = 0;
+    for (int i = 0; i < bucket_count - 1; i++) {
+        cumulative += buckets[i].load(std::memory_order_relaxed);
+        out += sample_name("_bucket", "le=\"" + std::to_string((1UL << i) - 1) + "\"") + " " +
+            std::to_string(cumulative) + "\n";
+    }
+    out += sample_name("_bucket", "le=\"+Inf\"") + " " + std::to_string(count()) + "\n";
+    out += sample_name("_sum") + " " + std::to_string(sum()) + "\n";
+    out += sample_name("_count") + " " + std::to_string(count()) + "\n";
+}
+
+void Counter::render(std::string &out) const {
+    out += name + " " + std::to_string(get()) + "\n";
+}
+
+void Gauge::render(std::string &out) const {
+    out += name + " " + std::to_string(get()) + "\n";
+}
+
+Histogram& stats_histogram(const std::string &name) {
+    std::lock_guard<std::mutex> guard(registry().lock);
+    std::unique_ptr<Histogram> &histogram = registry().histograms[name];
+    if (histogram == nullptr) {
+        histogram = std::make_unique<Histogram>(name);
+    }
+    return *histogram;
+}
+
+Counter& stats_counter(const std::string &name) {
+    std::lock_guard<std::mutex> guard(registry().lock);
+    std::unique_ptr<Counter> &counter = registry().counters[name];
+    if (counter == nullptr) {
+        counter = std::make_unique<Counter>(name);
+    }
+    return *counter;
+}
+
+Gauge& stats_gauge(const std::string &name) {
+    std::lock_guard<std::mutex> guard(registry().lock);
+    std::unique_ptr<Gauge> &gauge = registry().gauges[name];
+    if (gauge == nullptr) {
+        gauge = std::make_unique<Gauge>(name);
+    }
+    return *gauge;
+}
+
+std::string render_stats() {
+    std::lock_guard<std::mutex> guard(registry().lock);
+    std::string out;
+    std::string last_family;
+    for (const auto &[name, counter] : registry().counters) {
+        render_type(out, last_family, name, "counter");
+        counter->render(out);
+    }
+    for (const auto &[name, gauge] : registry().gauges) {
+        render_type(out, last_family, name, "gauge");
+        gauge->render(out);
+    }
+    for (const auto &[name, histogram] : registry().histograms) {
+        render_type(out, last_family, name, "histogram");
+        histogram->render(out);
+    }
+    return out;
+}
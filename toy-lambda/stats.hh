@@ -0,0 +1,115 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Metric names may carry Prometheus labels, as in name{label="value"}.
+
+// A histogram with power-of-two buckets. Bucket i counts values in
+// [2^(i-1), 2^i). Safe to record from any thread.
+class Histogram {
+public:
+    explicit Histogram(const std::string &name) : name(name) {}
+
+    Histogram(const Histogram &other) = delete;
+    Histogram& operator=(const Histogram &other) = delete;
+
+    void record(uint64_t value);
+
+    uint64_t count() const { return total_count.load(std::memory_order_relaxed); }
+
+    uint64_t sum() const { return total_sum.load(std::memory_order_relaxed); }
+
+    // Appends the histogram's samples to out in the Prometheus text format.
+    void render(std::string &out) const;
+
+private:
+    static const int bucket_count = 40;
+
+    // Returns name_suffix{labels,extra_label}.
+    std::string sample_name(const std::string &suffix, const std::string &extra_label = "") const;
+
+    const std::string name;
+    std::array<std::atomic<uint64_t>, bucket_count> buckets = {};
+    std::atomic<uint64_t> total_count = 0;
+    std::atomic<uint64_t> total_sum = 0;
+};
+
+// A monotonically increasing counter. Safe to update from any thread.
+class Counter {
+public:
+    explicit Counter(const std::string &name) : name(name) {}
+
+    Counter(const Counter &other) = delete;
+    Counter& operator=(const Counter &other) = delete;
+
+    void add(uint64_t delta = 1) { value.fetch_add(delta, std::memory_order_relaxed); }
+
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+    // Appends the counter's sample to out in the Prometheus text format.
+    void render(std::string &out) const;
+
+private:
+    const std::string name;
+    std::atomic<uint64_t> value = 0;
+};
+
+// A value that goes up and down. Safe to update from any thread.
+class Gauge {
+public:
+    explicit Gauge(const std::string &name) : name(name) {}
+
+    Gauge(const Gauge &other) = delete;
+    Gauge& operator=(const Gauge &other) = delete;
+
+    void add(int64_t delta) { value.fetch_add(delta, std::memory_order_relaxed); }
+
+    int64_t get() const { return value.load(std::memory_order_relaxed); }
+
+    // Appends the gauge's sample to out in the Prometheus text format.
+    void render(std::string &out) const;
+
+private:
+    const std::string name;
+    std::atomic<int64_t> value = 0;
+};
+
+// Records the microseconds from a request's arrival until it is finished.
+// Default-constructed timers record nothing.
+class RequestTimer {
+public:
+    RequestTimer() = default;
+
+    RequestTimer(Histogram &histogram, std::chrono::steady_clock::time_point start)
+        : histogram(&histogram), start(start) {}
+
+    void finish() const {
+        if (histogram != nullptr) {
+            histogram->record(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count());
+        }
+    }
+
+private:
+    Histogram *histogram = nullptr;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Returns the histogram registered under name, creating it on first use.
+// The returned reference is valid for the lifetime of the process.
+Histogram& stats_histogram(const std::string &name);
+
+// Returns the counter registered under name, creating it on first use.
+// The returned reference is valid for the lifetime of the process.
+Counter& stats_counter(const std::string &name);
+
+// Returns the gauge registered under name, creating it on first use.
+// The returned reference is valid for the lifetime of the process.
+Gauge& stats_gauge(const std::string &name);
+
+// Renders every registered metric, sorted by name.
+std::string render_stats();
@@ -1,7 +1,7 @@
 #include "tcp_socket.hh"
 
 std::optional<TCPSocket> TCPSocket::open(const std::string &address, short port) {
-    int socket_fd = socket(PF_INET, SOCK_STREAM, 0);
+    int socket_fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (socket_fd == -1) {
         return {};
     }
@@ -58,13 +58,21 @@ TCPSocket& TCPSocket::operator=(const TCPSocket &other) {
 std::optional<TCPSocket> TCPSocket::accept() const {
     struct sockaddr_in addr;
     socklen_t len = sizeof(addr);
-    int fd = ::accept(this->fd, (struct sockaddr *) &addr, &len);
+    int fd = accept4(this->fd, (struct sockaddr *) &addr, &len, SOCK_CLOEXEC);
     if (fd == -1) {
         return {};
     }
     return TCPSocket(fd);
 }
 
+bool TCPSocket::wait_readable(std::chrono::milliseconds timeout) const {
+    struct pollfd pfd = {
+        .fd = this->fd,
+        .events = POLLIN,
+    };
+    return poll(&pfd, 1, timeout.count()) > 0;
+}
+
 void TCPSocket::write(const std::string &msg) const {
     ::write(this->fd, msg.c_str(), msg.length());
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <memory>
 #include <optional>
 #include <string>
@@ -8,6 +9,7 @@
 extern "C" {
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -27,6 +29,10 @@ public:
 
     std::optional<TCPSocket> accept() const;
 
+    // Waits up to timeout for the socket to become readable (or, for a
+    // listening socket, for a connection to arrive).
+    bool wait_readable(std::chrono::milliseconds timeout) const;
+
     operator int() const { return fd; }
 
     void write(const std::string &msg) const;
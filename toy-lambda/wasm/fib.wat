@@ -0,0 +1,26 @@
+;; The Wasm counterpart of resources/fib.js and lib/fib.cc.
+;; main() returns the offset of a NUL-terminated string in memory.
+(module
+  (memory (export "memory") 1)
+
+  (func $fib (param $n i32) (result i32)
+    (if (result i32) (i32.lt_s (local.get $n) (i32.const 2))
+      (then (local.get $n))
+      (else
+        (i32.add
+          (call $fib (i32.sub (local.get $n) (i32.const 2)))
+          (call $fib (i32.sub (local.get $n) (i32.const 1)))))))
+
+  (func (export "main") (result i32)
+    (local $n i32)
+    (local $pos i32)
+    (local.set $n (call $fib (i32.const 20)))
+    ;; Write the digits backwards, ending at offset 47.
+    (local.set $pos (i32.const 47))
+    (i32.store8 (local.get $pos) (i32.const 0))
+    (loop $digits
+      (local.set $pos (i32.sub (local.get $pos) (i32.const 1)))
+      (i32.store8 (local.get $pos)
+        (i32.add (i32.rem_u (local.get $n) (i32.const 10)) (i32.const 48)))
+      (br_if $digits (local.tee $n (i32.div_u (local.get $n) (i32.const 10)))))
+    (local.get $pos)))
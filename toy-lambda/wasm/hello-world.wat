@@ -0,0 +1,8 @@
+;; The Wasm counterpart of resources/hello-world.js and lib/hello-world.cc.
+;; main() returns the offset of a NUL-terminated string in memory.
+(module
+  (memory (export "memory") 1)
+  (data (i32.const 16) "hello world\00")
+
+  (func (export "main") (result i32)
+    (i32.const 16)))
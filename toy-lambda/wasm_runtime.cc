@@ -0,0 +1,269 @@
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include "include/libplatform/libplatform.h"
+#include "stats.hh"
+#include "wasm_runtime.hh"
+
+using namespace std;
+
+namespace {
+
+// The module being compiled. The streaming callback has no data pointer of
+// its own, and a worker compiles one module at a time.
+struct CompileJob {
+    const string &name;
+    const string &wire_bytes;
+    const string cache_file;
+    const string cached_code;
+    bool cache_accepted = false;
+};
+
+CompileJob *current_job = nullptr;
+
+// Serializes cache writes, which V8 may trigger from background threads.
+mutex cache_lock;
+
+Counter &cache_hits = stats_counter("wasm_cache_hits");
+Counter &cache_misses = stats_counter("wasm_cache_misses");
+Histogram &compile_us = stats_histogram("wasm_compile_us");
+
+// Cached code is keyed by the wire bytes as well, so a module replaced under
+// the same name never picks up its predecessor's code.
+string cache_path(const string &name, const string &wire_bytes) {
+    return wasm_cache_directory + name + "-" + to_string(hash<string>()(wire_bytes)) + ".code";
+}
+
+string read_file(const string &path) {
+    ifstream file(path, ios::binary);
+    stringstream file_contents;
+    file_contents << file.rdbuf();
+    return file_contents.str();
+}
+
+void write_cache(const string &path, v8::CompiledWasmModule compiled) {
+    v8::OwnedBuffer serialized = compiled.Serialize();
+    if (serialized.size == 0) {
+        return;
+    }
+
+    lock_guard<mutex> guard(cache_lock);
+    error_code error;
+    filesystem::create_directories(wasm_cache_directory, error);
+
+    // Write to a temporary file first, so a crash never leaves a torn cache.
+    string temporary_path = path + ".tmp";
+    ofstream file(temporary_path, ios::binary | ios::trunc);
+    file.write(reinterpret_cast<const char*>(serialized.buffer.get()), serialized.size);
+    file.close();
+    if (!file) {
+        cerr << "Unable to write " << temporary_path << endl;
+        return;
+    }
+    filesystem::rename(temporary_path, path, error);
+}
+
+// Feeds the module being compiled to V8, preceded by its cached code.
+void stream_module(const v8::FunctionCallbackInfo<v8::Value> &info) {
+    shared_ptr<v8::WasmStreaming> streaming =
+        v8::WasmStreaming::Unpack(info.GetIsolate(), info.Data());
+    CompileJob *job = current_job;
+
+    if (!job->cached_code.empty()) {
+        job->cache_accepted = streaming->SetCompiledModuleBytes(
+            reinterpret_cast<const uint8_t*>(job->cached_code.data()), job->cached_code.size());
+    }
+
+    // TurboFan tiers up hot functions after Liftoff's first pass. Refresh
+    // the cache whenever that makes more code serializable.
+    string path = job->cache_file;
+    streaming->SetMoreFunctionsCanBeSerializedCallback(
+        [path](v8::CompiledWasmModule compiled) { write_cache(path, std::move(compiled)); });
+
+    streaming->SetUrl(job->name.c_str(), job->name.length());
+    streaming->OnBytesReceived(reinterpret_cast<const uint8_t*>(job->wire_bytes.data()),
+                               job->wire_bytes.size());
+    streaming->Finish();
+}
+
+v8::MaybeLocal<v8::Value> get_property(v8::Local<v8::Context> context, v8::Local<v8::Value> object,
+                                       const char *name) {
+    if (!object->IsObject()) {
+        return {};
+    }
+    v8::Isolate *isolate = context->GetIsolate();
+    return object.As<v8::Object>()->Get(context, v8::String::NewFromUtf8(isolate, name)
+                                        .ToLocalChecked());
+}
+
+}
+
+WasmWorker::WasmWorker(v8::Platform *platform) : platform(platform) {
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    allocator = create_params.array_buffer_allocator;
+    isolate = v8::Isolate::New(create_params);
+    isolate->SetMicrotasksPolicy(v8::MicrotasksPolicy::kExplicit);
+    isolate->SetWasmStreamingCallback(stream_module);
+
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    context.Reset(isolate, v8::Context::New(isolate));
+}
+
+WasmWorker::~WasmWorker() {
+    modules.clear();
+    context.Reset();
+    isolate->Dispose();
+    delete allocator;
+}
+
+bool WasmWorker::load_module(const string &name, const string &wire_bytes) {
+    auto start = chrono::steady_clock::now();
+    string cache_file = cache_path(name, wire_bytes);
+    CompileJob job = {name, wire_bytes, cache_file, read_file(cache_file)};
+
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = this->context.Get(isolate);
+    v8::Context::Scope context_scope(context);
+
+    v8::Local<v8::Value> compile_streaming;
+    if (!get_property(context, context->Global(), "WebAssembly").ToLocal(&compile_streaming) ||
+        !get_property(context, compile_streaming, "compileStreaming").ToLocal(&compile_streaming) ||
+        !compile_streaming->IsFunction()) {
+        cerr << "WebAssembly.compileStreaming() is unavailable." << endl;
+        return false;
+    }
+
+    current_job = &job;
+    v8::Local<v8::Value> argv[] = {v8::String::NewFromUtf8(isolate, name.c_str()).ToLocalChecked()};
+    v8::Local<v8::Value> rvalue;
+    bool started = compile_streaming.As<v8::Function>()
+        ->Call(context, v8::Undefined(isolate), 1, argv).ToLocal(&rvalue) && rvalue->IsPromise();
+    if (!started) {
+        current_job = nullptr;
+        cerr << "Unable to compile " << name << endl;
+        return false;
+    }
+
+    // Compilation finishes on V8's background threads and resolves the
+    // Promise through a foreground task.
+    v8::Local<v8::Promise> promise = rvalue.As<v8::Promise>();
+    isolate->PerformMicrotaskCheckpoint();
+    while (promise->State() == v8::Promise::kPending) {
+        v8::platform::PumpMessageLoop(platform, isolate,
+                                      v8::platform::MessageLoopBehavior::kWaitForWork);
+        isolate->PerformMicrotaskCheckpoint();
+    }
+    current_job = nullptr;
+
+    if (promise->State() != v8::Promise::kFulfilled || !promise->Result()->IsWasmModuleObject()) {
+        cerr << "Unable to compile " << name << endl;
+        return false;
+    }
+
+    v8::Local<v8::WasmModuleObject> module = promise->Result().As<v8::WasmModuleObject>();
+    // Cached code V8 accepted is already on disk; tier-up refreshes it.
+    if (!job.cache_accepted) {
+        write_cache(cache_file, module->GetCompiledModule());
+    }
+    (job.cache_accepted ? cache_hits : cache_misses).add();
+    compile_us.record(chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now() - start).count());
+
+    modules.erase(name);
+    modules[name].module.Reset(isolate, module);
+    return true;
+}
+
+optional<string> WasmWorker::call(const string &name) {
+    auto entry = modules.find(name);
+    if (entry == modules.end()) {
+        return {};
+    }
+    Module &module = entry->second;
+
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+    v8::Local<v8::Context> context = this->context.Get(isolate);
+    v8::Context::Scope context_scope(context);
+
+    unique_ptr<Instance> instance;
+    if (module.free_instances.empty()) {
+        instance = instantiate(context, module);
+        if (instance == nullptr) {
+            return {};
+        }
+    } else {
+        instance = std::move(module.free_instances.back());
+        module.free_instances.pop_back();
+    }
+
+    optional<string> result;
+    v8::Local<v8::Value> rvalue;
+    if (instance->main_func.Get(isolate)->Call(context, v8::Undefined(isolate), 0, nullptr)
+        .ToLocal(&rvalue) && rvalue->IsUint32()) {
+        v8::Local<v8::ArrayBuffer> buffer = instance->memory.Get(isolate)->Buffer();
+        const char *memory = static_cast<const char*>(buffer->Data());
+        size_t offset = rvalue.As<v8::Uint32>()->Value();
+        if (offset < buffer->ByteLength()) {
+            const char *end = static_cast<const char*>(
+                memchr(memory + offset, '\0', buffer->ByteLength() - offset));
+            if (end != nullptr) {
+                result = string(memory + offset, end);
+            }
+        }
+    }
+
+    if (reset(*instance)) {
+        module.free_instances.push_back(std::move(instance));
+    }
+    return result;
+}
+
+unique_ptr<WasmWorker::Instance> WasmWorker::instantiate(v8::Local<v8::Context> context,
+                                                         Module &module) {
+    v8::Local<v8::Value> constructor;
+    if (!get_property(context, context->Global(), "WebAssembly").ToLocal(&constructor) ||
+        !get_property(context, constructor, "Instance").ToLocal(&constructor) ||
+        !constructor->IsFunction()) {
+        return nullptr;
+    }
+
+    v8::Local<v8::Value> argv[] = {module.module.Get(isolate)};
+    v8::Local<v8::Object> instance_object;
+    v8::Local<v8::Value> exports, main_func, memory;
+    if (!constructor.As<v8::Function>()->NewInstance(context, 1, argv).ToLocal(&instance_object) ||
+        !get_property(context, instance_object, "exports").ToLocal(&exports) ||
+        !get_property(context, exports, "main").ToLocal(&main_func) ||
+        !get_property(context, exports, "memory").ToLocal(&memory) ||
+        !main_func->IsFunction() || !memory->IsWasmMemoryObject()) {
+        cerr << "Error: a Wasm function must export main() and memory." << endl;
+        return nullptr;
+    }
+
+    auto instance = make_unique<Instance>();
+    instance->main_func.Reset(isolate, main_func.As<v8::Function>());
+    instance->memory.Reset(isolate, memory.As<v8::WasmMemoryObject>());
+
+    v8::Local<v8::ArrayBuffer> buffer = memory.As<v8::WasmMemoryObject>()->Buffer();
+    const char *data = static_cast<const char*>(buffer->Data());
+    instance->pristine_memory.assign(data, data + buffer->ByteLength());
+    return instance;
+}
+
+bool WasmWorker::reset(Instance &instance) {
+    // Linear memory cannot shrink, so an instance that grew is dropped.
+    v8::Local<v8::ArrayBuffer> buffer = instance.memory.Get(isolate)->Buffer();
+    if (buffer->ByteLength() != instance.pristine_memory.size()) {
+        return false;
+    }
+
+    memcpy(buffer->Data(), instance.pristine_memory.data(), instance.pristine_memory.size());
+    return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "include/v8.h"
+
+// Where compiled modules are serialized, so restarts skip compilation.
+const std::string wasm_cache_directory = "build/wasm-cache/";
+
+// Runs WebAssembly functions on one worker thread. Each module keeps a pool
+// of instances whose linear memory is reset between calls.
+//
+// A function module exports "memory" and "main", where main() takes no
+// arguments and returns the offset of a NUL-terminated string in memory, like
+// the f() of a NaCl function. Only memory is reset, so modules should not
+// keep state in mutable globals.
+class WasmWorker {
+public:
+    explicit WasmWorker(v8::Platform *platform);
+
+    ~WasmWorker();
+
+    WasmWorker(const WasmWorker &other) = delete;
+    WasmWorker& operator=(const WasmWorker &other) = delete;
+
+    // Compiles a module, starting from its serialized code in the cache when
+    // possible, and replaces any module loaded under name. Returns false if
+    // the module is invalid.
+    bool load_module(const std::string &name, const std::string &wire_bytes);
+
+    bool contains(const std::string &name) const { return modules.contains(name); }
+
+    // Drops a module and its instances.
+    void unload(const std::string &name) { modules.erase(name); }
+
+    // Calls the module's main() and returns the string it points to.
+    std::optional<std::string> call(const std::string &name);
+
+private:
+    struct Instance {
+        v8::Global<v8::Function> main_func;
+        v8::Global<v8::WasmMemoryObject> memory;
+
+        // Linear memory right after instantiation, restored after each call.
+        std::vector<char> pristine_memory;
+    };
+
+    struct Module {
+        v8::Global<v8::WasmModuleObject> module;
+        std::vector<std::unique_ptr<Instance>> free_instances;
+    };
+
+    std::unique_ptr<Instance> instantiate(v8::Local<v8::Context> context, Module &module);
+
+    // Restores memory to its pristine state. Returns false if that is not
+    // possible because the call grew memory.
+    bool reset(Instance &instance);
+
+    v8::Platform *platform;
+    v8::Isolate *isolate;
+    v8::ArrayBuffer::Allocator *allocator;
+    v8::Global<v8::Context> context;
+    std::map<std::string, Module> modules;
+};
@@ -0,0 +1,67 @@
+#include "watchdog.hh"
+
+extern "C" {
+#include <pthread.h>
+}
+
+using namespace std;
+
+namespace {
+
+chrono::nanoseconds cpu_time(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return chrono::seconds(now.tv_sec) + chrono::nanoseconds(now.tv_nsec);
+}
+
+}
+
+ExecutionWatchdog::ExecutionWatchdog() : thread(&ExecutionWatchdog::run, this) {}
+
+ExecutionWatchdog::~ExecutionWatchdog() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wakeup.notify_one();
+    thread.join();
+}
+
+void ExecutionWatchdog::arm(v8::Isolate *isolate, chrono::nanoseconds budget) {
+    {
+        lock_guard<mutex> guard(lock);
+        pthread_getcpuclockid(pthread_self(), &cpu_clock);
+        cpu_start = cpu_time(cpu_clock);
+        this->budget = budget;
+        this->isolate = isolate;
+        fired = false;
+    }
+    wakeup.notify_one();
+}
+
+bool ExecutionWatchdog::disarm() {
+    lock_guard<mutex> guard(lock);
+    isolate = nullptr;
+    return fired;
+}
+
+void ExecutionWatchdog::run() {
+    unique_lock<mutex> guard(lock);
+    while (!stopping) {
+        if (isolate == nullptr || fired) {
+            wakeup.wait(guard);
+            continue;
+        }
+
+        chrono::nanoseconds used = cpu_time(cpu_clock) - cpu_start;
+        if (used >= budget) {
+            isolate->TerminateExecution();
+            fired = true;
+            continue;
+        }
+
+        // CPU time never advances faster than wall time, so the budget cannot
+        // expire before the remaining amount has elapsed.
+        wakeup.wait_for(guard, budget - used);
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "include/v8.h"
+
+extern "C" {
+#include <time.h>
+}
+
+// Terminates JS that runs past its CPU budget. One watchdog serves one worker
+// thread; its own thread sleeps until the armed budget could have expired.
+class ExecutionWatchdog {
+public:
+    ExecutionWatchdog();
+
+    ~ExecutionWatchdog();
+
+    ExecutionWatchdog(const ExecutionWatchdog &other) = delete;
+    ExecutionWatchdog& operator=(const ExecutionWatchdog &other) = delete;
+
+    // Starts charging the calling thread's CPU time against budget. Once it is
+    // spent, the watchdog calls isolate->TerminateExecution().
+    void arm(v8::Isolate *isolate, std::chrono::nanoseconds budget);
+
+    // Stops charging. Returns true if the budget expired, in which case the
+    // caller must call CancelTerminateExecution() before reusing the isolate.
+    bool disarm();
+
+private:
+    void run();
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+
+    // The isolate being watched, or nullptr while disarmed.
+    v8::Isolate *isolate = nullptr;
+    clockid_t cpu_clock;
+    std::chrono::nanoseconds cpu_start;
+    std::chrono::nanoseconds budget;
+    bool fired = false;
+    bool stopping = false;
+
+    std::thread thread;
+};